@@ -0,0 +1,76 @@
+#!/bin/sh
+# Benchmark suite.
+#
+# Runs copy, paste, head, tail, stdin and append against the stub clipboard
+# in bench/fake (no X server needed) for each payload size, and reports
+# throughput at the median, p50/p99 wall time, peak RSS and, when strace is
+# installed, the number of syscalls of one run. Throughput is payload size
+# over median time, so for head and tail it shows how little they read.
+#
+# Usage: bench/bench.sh [SIZE...]          (default: 1K 1M 64M; try 1G 4G)
+#        RUNS=20 bench/bench.sh            runs per case (default 10)
+#        COPY=/path/to/copy bench/bench.sh to measure another build
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+if [ -z "$COPY" ]; then
+    COPY="$WORK/copy"
+    gcc -O2 -pthread -o "$COPY" "$ROOT/main.c"
+fi
+if [ -z "$MEASURE" ]; then
+    MEASURE="$WORK/measure"
+    gcc -O2 -o "$MEASURE" "$ROOT/bench/measure.c"
+fi
+RUNS=${RUNS:-10}
+
+# Stub backend, and nothing that could reach a real clipboard or daemon
+export PATH="$ROOT/bench/fake:$PATH"
+export COPY_BENCH_CLIP="$WORK/clip"
+export COPY_HISTORY_FILE="$WORK/history"
+export XDG_RUNTIME_DIR="$WORK"
+export COPY_NO_DAEMON=1
+export DISPLAY=:bench
+unset WAYLAND_DISPLAY
+
+HAVE_STRACE=
+command -v strace > /dev/null 2>&1 && HAVE_STRACE=1
+
+mbps() { awk -v b="$1" -v ms="$2" 'BEGIN { printf "%.1f", (ms > 0 ? (b / 1048576) / (ms / 1e3) : 0) }'; }
+
+# Syscalls made by one run of the command, every process included
+syscalls() {
+    if [ -z "$HAVE_STRACE" ]; then
+        echo "-"
+        return
+    fi
+    strace -f -c -o "$WORK/strace" sh -c "$1" > /dev/null 2>&1
+    awk '$NF == "total" { print $4 }' "$WORK/strace"
+}
+
+# case size bytes command
+run_case() {
+    set -- "$1" "$2" "$3" "$4" $("$MEASURE" "$RUNS" "$4")
+    printf "%-7s %7s %10s %10s %10s %10s %9s\n" \
+        "$1" "$2" "$(mbps "$3" "$5")" "$5" "$6" "$7" "$(syscalls "$4")"
+}
+
+printf "%-7s %7s %10s %10s %10s %10s %9s\n" \
+    "case" "size" "MB/s" "p50 ms" "p99 ms" "RSS KB" "syscalls"
+for size in ${*:-1K 1M 64M}; do
+    P="$WORK/payload"
+    yes "The quick brown fox jumps over the lazy dog 0123456789" | head -c "$size" > "$P"
+    bytes=$(wc -c < "$P")
+
+    run_case copy   "$size" "$bytes" "'$COPY' -f '$P'"
+    cmp -s "$P" "$COPY_BENCH_CLIP" || { echo "copy corrupted the payload" >&2; exit 1; }
+    run_case paste  "$size" "$bytes" "'$COPY' -p -f '$WORK/out'"
+    cmp -s "$P" "$WORK/out" || { echo "paste corrupted the payload" >&2; exit 1; }
+    run_case head   "$size" "$bytes" "'$COPY' -o -l 10 '$P'"
+    run_case tail   "$size" "$bytes" "'$COPY' -o -t 10 '$P'"
+    run_case stdin  "$size" "$bytes" "cat '$P' | '$COPY' -s"
+    run_case append "$size" "$bytes" ": > '$WORK/out'; '$COPY' -p -a '$WORK/out'"
+    rm -f "$P" "$WORK/out"
+done
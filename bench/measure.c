@@ -0,0 +1,85 @@
+// Benchmark runner: runs a shell command RUNS times and prints
+// "p50_ms p99_ms peak_rss_kb" for the runs on one line.
+//
+// Each run is timed with CLOCK_MONOTONIC around fork/exec/wait4. The RSS
+// figure is the largest ru_maxrss wait4 reports for `sh -c`, which on Linux
+// covers every process of the pipeline the shell waited for. The command's
+// stdout and stderr go to /dev/null unless it redirects them itself.
+//
+// Usage: measure RUNS 'command'
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const double *sorted, int count, int pct) {
+    int rank = (count * pct + 99) / 100;
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 || atoi(argv[1]) <= 0) {
+        fprintf(stderr, "Usage: %s RUNS 'command'\n", argv[0]);
+        return 2;
+    }
+    int runs = atoi(argv[1]);
+    double *times = malloc(runs * sizeof(*times));
+    if (!times) return 1;
+    long peak_rss = 0;
+
+    for (int i = 0; i < runs; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+            }
+            execl("/bin/sh", "sh", "-c", argv[2], (char *)NULL);
+            _exit(127);
+        }
+
+        int status;
+        struct rusage usage;
+        while (wait4(pid, &status, 0, &usage) < 0) {
+            if (errno != EINTR) {
+                perror("wait4");
+                return 1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "measure: command failed: %s\n", argv[2]);
+            return 1;
+        }
+        times[i] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (usage.ru_maxrss > peak_rss) peak_rss = usage.ru_maxrss;
+    }
+
+    qsort(times, runs, sizeof(*times), compare_doubles);
+    printf("%.3f %.3f %ld\n", percentile(times, runs, 50), percentile(times, runs, 99), peak_rss);
+    free(times);
+    return 0;
+}
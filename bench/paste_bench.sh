@@ -0,0 +1,59 @@
+#!/bin/sh
+# Paste throughput benchmark.
+#
+# Runs `copy -p` against the stub xclip in bench/fake, serving a payload of
+# each size, and reports MB/s for pasting to stdout (/dev/null) and to a file.
+#
+# Usage: bench/paste_bench.sh [SIZE...]      (default: 1M 16M 128M 1G)
+#        COPY=/path/to/copy bench/paste_bench.sh   to measure another build
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+if [ -z "$COPY" ]; then
+    COPY="$WORK/copy"
+    gcc -O2 -pthread -o "$COPY" "$ROOT/main.c"
+fi
+RUNS=${RUNS:-3}
+
+# Stub backend from bench/fake serving the current payload, and nothing that
+# could reach a real clipboard or daemon
+export PATH="$ROOT/bench/fake:$PATH"
+export COPY_BENCH_CLIP="$WORK/payload"
+export COPY_HISTORY_FILE="$WORK/history"
+export XDG_RUNTIME_DIR="$WORK"
+export COPY_NO_DAEMON=1
+export DISPLAY=:bench
+unset WAYLAND_DISPLAY
+
+now_ns() { date +%s%N; }
+
+# Best-of-$RUNS wall time in nanoseconds for the given command
+best_ns() {
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now_ns)
+        "$@" > /dev/null
+        elapsed=$(( $(now_ns) - start ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then best=$elapsed; fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+mbps() { awk -v b="$1" -v ns="$2" 'BEGIN { printf "%.1f", (b / 1048576) / (ns / 1e9) }'; }
+
+printf "%-8s %14s %14s\n" "size" "stdout MB/s" "file MB/s"
+for size in ${*:-1M 16M 128M 1G}; do
+    yes "The quick brown fox jumps over the lazy dog 0123456789" | head -c "$size" > "$WORK/payload"
+    bytes=$(wc -c < "$WORK/payload")
+    
+    t_stdout=$(best_ns "$COPY" -p)
+    t_file=$(best_ns "$COPY" -p -f "$WORK/out")
+    cmp -s "$WORK/payload" "$WORK/out" || { echo "paste to file corrupted the payload" >&2; exit 1; }
+    
+    printf "%-8s %14s %14s\n" "$size" "$(mbps "$bytes" "$t_stdout")" "$(mbps "$bytes" "$t_file")"
+done
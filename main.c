@@ -1,8 +1,15 @@
+#ifdef __linux__
+    #define _GNU_SOURCE  // splice(2), copy_file_range(2)
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
@@ -15,26 +22,756 @@
     #define IS_WINDOWS 1
 #else
     #include <sys/wait.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/uio.h>
+    #include <sys/time.h>
+    #include <sys/file.h>
+    #include <sys/resource.h>
+    #include <spawn.h>
+    #include <pthread.h>
+    #include <poll.h>
+    #include <signal.h>
     #include <dirent.h>
     #include <termios.h>  // For terminal control
+    #include <regex.h>    // --grep --regex
     #define PATH_SEPARATOR '/'
     #define IS_WINDOWS 0
+    extern char **environ;  // Passed to posix_spawnp
+#endif
+
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_XCB
+    #include <xcb/xcb.h>  // Native X11 backend: gcc -DHAVE_XCB ... -lxcb
+#endif
+
+#ifndef O_BINARY
+    #define O_BINARY 0
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <immintrin.h>
+    #define HAVE_X86_SIMD 1  // SSE2 baseline, AVX2/AVX-512 picked at runtime
 #endif
 
 // Configuration
 #define MAX_PATH_LENGTH 4096
-#define MAX_FILE_SIZE (100 * 1024 * 1024) // 100MB limit
+#define DEFAULT_MAX_SIZE (100 * 1024 * 1024) // 100MB default for -m/--max-size
 #define BUFFER_SIZE 65536
+#define MMAP_THRESHOLD BUFFER_SIZE // Smaller files are read, larger ones mapped
+#define SPLICE_CHUNK (16 * BUFFER_SIZE) // Bytes moved per splice(2) call
+#define DEFAULT_MEMORY_BUDGET (64 * 1024 * 1024) // Heap per capture before spilling
 #define VERSION "1.1.0"
 
 // Function prototypes
 void print_help();
+void print_clipboard_hint();
 bool get_user_confirmation(const char *prompt, bool default_no);
 char* get_human_readable_size(off_t bytes);
+#ifndef _WIN32
+ssize_t stream_fd(int in_fd, off_t *off, int out_fd);
+#endif
+
+// Instrumentation
+// --stats and COPY_TRACE=1 print one JSON line on stderr at exit: wall and
+// CPU time, time and call counts per phase, bytes moved, heap growth, page
+// faults and peak RSS. Phases are timed at the leaves (stat calls, reads,
+// transforms, helper spawn/wait, writes, kernel-side streaming); a span
+// opened inside another one on the same thread folds into the outer one, so
+// phase times never double count. Disabled, every span and counter is one
+// predictable branch.
+typedef enum {
+    PHASE_STAT,       // stat(2) and friends on input/output paths
+    PHASE_READ,       // Reading or mapping input into memory
+    PHASE_TRANSFORM,  // head/tail/trim selection
+    PHASE_SPAWN,      // Starting helpers and selection owners
+    PHASE_STREAM,     // Moving data fd to fd (splice, sendfile, tee, ...)
+    PHASE_WRITE,      // Writing buffers out
+    PHASE_WAIT,       // Waiting for helpers to exit
+    PHASE_COUNT
+} StatsPhase;
+
+static const char *const stats_phase_names[PHASE_COUNT] = {
+    "stat", "read", "transform", "spawn", "stream", "write", "wait",
+};
+
+typedef struct {
+    bool enabled;
+    uint64_t start_ns;
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t phase_calls[PHASE_COUNT];
+    uint64_t bytes_read;       // Into our memory (read(2), fread)
+    uint64_t bytes_mapped;     // Input mapped instead of read
+    uint64_t bytes_written;    // Out of our memory (write(2), writev(2))
+    uint64_t bytes_streamed;   // Through stream_fd/tee without a heap buffer
+    uint64_t allocations;      // Heap buffer growths
+    uint64_t allocated_bytes;
+    uint64_t spilled_bytes;    // Captures moved to disk over the memory budget
+} Stats;
+
+static Stats stats;
+static __thread int stats_depth;  // Spans open on this thread
+
+uint64_t monotonic_ns() {
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(now.QuadPart / (double)freq.QuadPart * 1e9);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+    if (__builtin_expect(stats.enabled, 0)) __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+    StatsPhase phase;
+    uint64_t start;
+} StatsSpan;
+
+static inline StatsSpan stats_span_begin(StatsPhase phase) {
+    StatsSpan span = { phase, 0 };
+    if (__builtin_expect(stats.enabled, 0) && stats_depth++ == 0) span.start = monotonic_ns();
+    return span;
+}
+
+static inline void stats_span_end(StatsSpan *span) {
+    if (__builtin_expect(stats.enabled, 0) && --stats_depth == 0) {
+        __atomic_fetch_add(&stats.phase_ns[span->phase], monotonic_ns() - span->start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.phase_calls[span->phase], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Time the rest of the enclosing scope, whichever way it is left
+#define STATS_SPAN(phase) \
+    StatsSpan stats_span __attribute__((cleanup(stats_span_end))) = stats_span_begin(phase)
+
+// Content buffer passed between every read, transform and write stage.
+// It carries its own length, so content is binary-safe (embedded NULs are
+// kept) and never rescanned with strlen. Transforms such as head/tail/trim
+// return borrowed views into their input instead of copies.
+typedef enum {
+    BUFFER_HEAP,      // malloc'd, grows geometrically; freed by buffer_free
+    BUFFER_MAPPED,    // Read-only file mapping; unmapped by buffer_free
+    BUFFER_BORROWED   // View into memory owned by another buffer
+} BufferOwner;
+
+typedef struct {
+    char *ptr;
+    size_t len;
+    size_t capacity;
+    BufferOwner owner;
+} Buffer;
+
+// Heap a single capture may use before it spills to disk (0 = unlimited),
+// set by --memory-budget or COPY_MEMORY_BUDGET
+static size_t memory_budget = DEFAULT_MEMORY_BUDGET;
+
+void buffer_init(Buffer *buf) {
+    buf->ptr = NULL;
+    buf->len = 0;
+    buf->capacity = 0;
+    buf->owner = BUFFER_HEAP;
+}
+
+Buffer buffer_view(const char *ptr, size_t len) {
+    Buffer view = { (char *)ptr, len, len, BUFFER_BORROWED };
+    return view;
+}
+
+Buffer buffer_slice(const Buffer *buf, size_t offset, size_t len) {
+    return buffer_view(buf->ptr + offset, len);
+}
+
+// Make room for `extra` more bytes (plus a spare byte so callers handing
+// the content to C APIs can NUL-terminate it). Only heap buffers grow.
+bool buffer_reserve(Buffer *buf, size_t extra) {
+    if (buf->owner != BUFFER_HEAP) return false;
+    if (buf->len + extra + 1 <= buf->capacity) return true;
+    
+    size_t capacity = buf->capacity ? buf->capacity : BUFFER_SIZE;
+    while (capacity < buf->len + extra + 1) capacity *= 2;
+    
+    char *grown = realloc(buf->ptr, capacity);
+    if (!grown) return false;
+    stats_add(&stats.allocations, 1);
+    stats_add(&stats.allocated_bytes, capacity - buf->capacity);
+    buf->ptr = grown;
+    buf->capacity = capacity;
+    return true;
+}
+
+bool buffer_append(Buffer *buf, const void *data, size_t len) {
+    if (!buffer_reserve(buf, len)) return false;
+    memcpy(buf->ptr + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+void buffer_free(Buffer *buf) {
+#ifndef _WIN32
+    if (buf->owner == BUFFER_MAPPED) {
+        if (buf->ptr) munmap(buf->ptr, buf->len);
+    } else
+#endif
+    if (buf->owner == BUFFER_HEAP) {
+        free(buf->ptr);
+    }
+    buffer_init(buf);
+}
+
+// Write a whole buffer to a stdio stream
+bool buffer_write(const Buffer *buf, FILE *stream) {
+    return buf->len == 0 || fwrite(buf->ptr, 1, buf->len, stream) == buf->len;
+}
+
+// Write a whole buffer to an fd, retrying short writes
+bool buffer_write_fd(const Buffer *buf, int fd) {
+    STATS_SPAN(PHASE_WRITE);
+    stats_add(&stats.bytes_written, buf->len);
+    size_t done = 0;
+    while (done < buf->len) {
+        ssize_t n = write(fd, buf->ptr + done, buf->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Write several buffers back to back, retrying short writes. One writev(2)
+// call covers all of them in the common case.
+bool buffer_writev_fd(const Buffer *parts, int count, int fd) {
+    STATS_SPAN(PHASE_WRITE);
+#ifdef _WIN32
+    for (int i = 0; i < count; i++) {
+        if (!buffer_write_fd(&parts[i], fd)) return false;
+    }
+    return true;
+#else
+    struct iovec iov[8];
+    if (count > 8) return false;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (parts[i].len == 0) continue;
+        iov[n].iov_base = parts[i].ptr;
+        iov[n].iov_len = parts[i].len;
+        n++;
+    }
+    
+    struct iovec *next = iov;
+    while (n > 0) {
+        ssize_t written = writev(fd, next, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        stats_add(&stats.bytes_written, written);
+        while (n > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            n--;
+        }
+        if (n > 0) {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return true;
+#endif
+}
+
+#ifndef _WIN32
+// Anonymous scratch file in $TMPDIR, gone as soon as it is closed
+int spill_file_create() {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    int fd;
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+#endif
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/copy-spill.XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd < 0) return -1;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+// Move a heap buffer that hit the memory budget to an unlinked temp file,
+// stream the rest of fd after it, and map the result in its place. The
+// pages are then file-backed, so the kernel can write them out instead of
+// the heap growing without bound.
+bool buffer_spill_fd(Buffer *buf, int fd) {
+    int spill = spill_file_create();
+    if (spill < 0) {
+        fprintf(stderr, "Error: Cannot create spill file: %s\n", strerror(errno));
+        return false;
+    }
+    bool ok = buffer_write_fd(buf, spill) && stream_fd(fd, NULL, spill) >= 0;
+    struct stat st;
+    ok = ok && fstat(spill, &st) == 0;
+    
+    void *map = MAP_FAILED;
+    if (ok && st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, spill, 0);
+        ok = map != MAP_FAILED;
+    }
+    close(spill);  // The mapping keeps the file alive
+    if (!ok) return false;
+    
+    buffer_free(buf);
+    if (map != MAP_FAILED) {
+        madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+        buf->ptr = map;
+        buf->len = buf->capacity = (size_t)st.st_size;
+        buf->owner = BUFFER_MAPPED;
+    }
+    stats_add(&stats.spilled_bytes, (uint64_t)st.st_size);
+    return true;
+}
+#endif
+
+// Read fd to EOF, appending to buf. A heap buffer that would outgrow the
+// memory budget is spilled to disk and comes back read-only (mapped).
+bool buffer_read_fd(Buffer *buf, int fd) {
+    STATS_SPAN(PHASE_READ);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (memory_budget == 0 || buf->len + (size_t)st.st_size < memory_budget)) {
+        if (!buffer_reserve(buf, (size_t)st.st_size)) return false;
+    }
+    
+    for (;;) {
+#ifndef _WIN32
+        if (memory_budget > 0 && buf->owner == BUFFER_HEAP &&
+            buf->len + BUFFER_SIZE > memory_budget) {
+            return buffer_spill_fd(buf, fd);
+        }
+#endif
+        if (!buffer_reserve(buf, BUFFER_SIZE)) return false;
+        ssize_t n = read(fd, buf->ptr + buf->len, buf->capacity - buf->len - 1);
+        if (n == 0) return true;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        stats_add(&stats.bytes_read, n);
+        buf->len += n;
+    }
+}
+
+// Clipboard content being pasted. Backends that produce a pipe (the
+// helpers, Wayland) are streamed from fd; the rest deliver everything into
+// data. The first chunk of a pipe is prefetched into data so callers can
+// tell an empty clipboard apart before touching the destination.
+typedef struct {
+    int fd;          // Pipe delivering the rest of the content, or -1
+    pid_t pid;       // Helper process behind fd, or -1
+    int conn_fd;     // Connection (or locked file) that must outlive the transfer
+    Buffer data;     // Prefetched or complete content
+    Buffer backing;  // Mapping data borrows from, if any
+    bool eof;        // fd has been drained
+} ClipReader;
+
+void clip_reader_init(ClipReader *r) {
+    r->fd = -1;
+    r->pid = -1;
+    r->conn_fd = -1;
+    buffer_init(&r->data);
+    buffer_init(&r->backing);
+    r->eof = false;
+}
+
+// Scanning kernels
+// Newline search/counting, literal search and whitespace trimming run over
+// whole files, so each has SSE2, AVX2 and AVX-512BW versions next to the
+// portable one. The widest set the CPU supports is chosen once at startup
+// via cpuid; COPY_SIMD=scalar|sse2|avx2|avx512 forces a particular one.
+typedef struct {
+    const char *name;
+    const char* (*find_newline)(const char *p, size_t len);
+    const char* (*find_last_newline)(const char *p, size_t len);
+    size_t (*count_newlines)(const char *p, size_t len);
+    size_t (*leading_space)(const char *p, size_t len);   // Length of the leading run
+    size_t (*trailing_space)(const char *p, size_t len);  // Length of the trailing run
+    const char* (*find_literal)(const char *p, size_t len, const char *needle, size_t needle_len);
+} ScanKernels;
+
+// isspace() in the C locale: space, \t, \n, \v, \f, \r
+static inline bool is_space_byte(unsigned char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+const char* find_newline_scalar(const char *p, size_t len) {
+    return memchr(p, '\n', len);
+}
+
+const char* find_last_newline_scalar(const char *p, size_t len) {
+    while (len > 0) {
+        if (p[--len] == '\n') return p + len;
+    }
+    return NULL;
+}
+
+size_t count_newlines_scalar(const char *p, size_t len) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) count += p[i] == '\n';
+    return count;
+}
+
+size_t leading_space_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && is_space_byte(p[i])) i++;
+    return i;
+}
+
+size_t trailing_space_scalar(const char *p, size_t len) {
+    size_t i = len;
+    while (i > 0 && is_space_byte(p[i - 1])) i--;
+    return len - i;
+}
+
+const char* find_literal_scalar(const char *p, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return p;
+    const char *end = p + len;
+    while ((size_t)(end - p) >= needle_len) {
+        p = memchr(p, needle[0], end - p - needle_len + 1);
+        if (!p) return NULL;
+        if (memcmp(p + 1, needle + 1, needle_len - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+// The vector literal searches compare a block against the needle's first
+// byte and, needle_len - 1 bytes further on, its last byte; only positions
+// where both match are checked with memcmp. That skips almost everything
+// in one pass even for needles whose first byte is common.
+//
+// The AVX2 kernels hand short tails to the SSE2 ones, which are encoded
+// without VEX, so they clear the upper register halves first; otherwise
+// every SSE instruction after them pays an AVX/SSE transition penalty.
+
+// SSE2 is part of the x86-64 baseline and needs no target attribute
+static inline __m128i space_mask_sse2(__m128i v) {
+    __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8('\r' - '\t')), shifted);
+    return _mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+const char* find_newline_sse2(const char *p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        if (mask) return p + i + __builtin_ctz(mask);
+    }
+    return find_newline_scalar(p + i, len - i);
+}
+
+const char* find_last_newline_sse2(const char *p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = len;
+    while (i >= 16) {
+        i -= 16;
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        if (mask) return p + i + 31 - __builtin_clz(mask);
+    }
+    return find_last_newline_scalar(p, i);
+}
+
+size_t count_newlines_sse2(const char *p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0, i = 0;
+    
+    // Per-byte counters can take 255 matches before being folded with SAD
+    while (len - i >= 16) {
+        size_t vectors = (len - i) / 16;
+        if (vectors > 255) vectors = 255;
+        __m128i acc = zero;
+        for (size_t v = 0; v < vectors; v++, i += 16) {
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    return count + count_newlines_scalar(p + i, len - i);
+}
+
+size_t leading_space_sse2(const char *p, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = _mm_movemask_epi8(space_mask_sse2(_mm_loadu_si128((const __m128i *)(p + i))));
+        if (mask != 0xFFFF) return i + __builtin_ctz(~mask);
+    }
+    return i + leading_space_scalar(p + i, len - i);
+}
+
+size_t trailing_space_sse2(const char *p, size_t len) {
+    size_t i = len;
+    while (i >= 16) {
+        unsigned mask = _mm_movemask_epi8(space_mask_sse2(_mm_loadu_si128((const __m128i *)(p + i - 16))));
+        if (mask != 0xFFFF) return len - i + __builtin_clz(~mask << 16);
+        i -= 16;
+    }
+    return len - i + trailing_space_scalar(p, i);
+}
+
+const char* find_literal_sse2(const char *p, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2) return needle_len ? memchr(p, needle[0], len) : p;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + needle_len - 1)), last);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(p + i + bit + 1, needle + 1, needle_len - 2) == 0) return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_scalar(p + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i space_mask_avx2(__m256i v) {
+    __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8('\r' - '\t')), shifted);
+    return _mm256_or_si256(control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+const char* find_newline_avx2(const char *p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), nl);
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) continue;
+        unsigned mask = _mm256_movemask_epi8(a);
+        if (mask) return p + i + __builtin_ctz(mask);
+        return p + i + 32 + __builtin_ctz((unsigned)_mm256_movemask_epi8(b));
+    }
+    _mm256_zeroupper();
+    return find_newline_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+const char* find_last_newline_avx2(const char *p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = len;
+    while (i >= 32) {
+        i -= 32;
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+        if (mask) return p + i + 31 - __builtin_clz(mask);
+    }
+    _mm256_zeroupper();
+    return find_last_newline_sse2(p, i);
+}
+
+__attribute__((target("avx2")))
+size_t count_newlines_avx2(const char *p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0, i = 0;
+    
+    while (len - i >= 32) {
+        size_t vectors = (len - i) / 32;
+        if (vectors > 255) vectors = 255;
+        __m256i acc = zero;
+        for (size_t v = 0; v < vectors; v++, i += 32) {
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    _mm256_zeroupper();
+    return count + count_newlines_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t leading_space_avx2(const char *p, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(space_mask_avx2(_mm256_loadu_si256((const __m256i *)(p + i))));
+        if (mask != 0xFFFFFFFFu) return i + __builtin_ctz(~mask);
+    }
+    _mm256_zeroupper();
+    return i + leading_space_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t trailing_space_avx2(const char *p, size_t len) {
+    size_t i = len;
+    while (i >= 32) {
+        unsigned mask = _mm256_movemask_epi8(space_mask_avx2(_mm256_loadu_si256((const __m256i *)(p + i - 32))));
+        if (mask != 0xFFFFFFFFu) return len - i + __builtin_clz(~mask);
+        i -= 32;
+    }
+    _mm256_zeroupper();
+    return len - i + trailing_space_sse2(p, i);
+}
+
+__attribute__((target("avx2")))
+const char* find_literal_avx2(const char *p, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2) return needle_len ? memchr(p, needle[0], len) : p;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + needle_len - 1)), last);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(p + i + bit + 1, needle + 1, needle_len - 2) == 0) return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    _mm256_zeroupper();
+    return find_literal_sse2(p + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx512bw")))
+static inline __mmask64 space_mask_avx512(__m512i v) {
+    __m512i shifted = _mm512_sub_epi8(v, _mm512_set1_epi8('\t'));
+    return _mm512_cmple_epu8_mask(shifted, _mm512_set1_epi8('\r' - '\t')) |
+           _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512bw")))
+const char* find_newline_avx512(const char *p, size_t len) {
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i)), nl);
+        if (mask) return p + i + __builtin_ctzll(mask);
+    }
+    return find_newline_avx2(p + i, len - i);
+}
+
+__attribute__((target("avx512bw")))
+const char* find_last_newline_avx512(const char *p, size_t len) {
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t i = len;
+    while (i >= 64) {
+        i -= 64;
+        __mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i)), nl);
+        if (mask) return p + i + 63 - __builtin_clzll(mask);
+    }
+    return find_last_newline_avx2(p, i);
+}
+
+__attribute__((target("avx512bw,popcnt")))
+size_t count_newlines_avx512(const char *p, size_t len) {
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 256 <= len; i += 256) {
+        count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i)), nl));
+        count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i + 64)), nl));
+        count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i + 128)), nl));
+        count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i + 192)), nl));
+    }
+    return count + count_newlines_avx2(p + i, len - i);
+}
+
+__attribute__((target("avx512bw")))
+size_t leading_space_avx512(const char *p, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __mmask64 mask = space_mask_avx512(_mm512_loadu_si512((const void *)(p + i)));
+        if (~mask) return i + __builtin_ctzll(~mask);
+    }
+    return i + leading_space_avx2(p + i, len - i);
+}
+
+__attribute__((target("avx512bw")))
+size_t trailing_space_avx512(const char *p, size_t len) {
+    size_t i = len;
+    while (i >= 64) {
+        __mmask64 mask = space_mask_avx512(_mm512_loadu_si512((const void *)(p + i - 64)));
+        if (~mask) return len - i + __builtin_clzll(~mask);
+        i -= 64;
+    }
+    return len - i + trailing_space_avx2(p, i);
+}
+
+__attribute__((target("avx512bw")))
+const char* find_literal_avx512(const char *p, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2) return needle_len ? memchr(p, needle[0], len) : p;
+    const __m512i first = _mm512_set1_epi8(needle[0]);
+    const __m512i last = _mm512_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 64 <= len; i += 64) {
+        __mmask64 mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i)), first) &
+                         _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(p + i + needle_len - 1)), last);
+        while (mask) {
+            unsigned bit = __builtin_ctzll(mask);
+            if (memcmp(p + i + bit + 1, needle + 1, needle_len - 2) == 0) return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_avx2(p + i, len - i, needle, needle_len);
+}
+#endif
+
+static const ScanKernels scan_kernel_table[] = {
+    { "scalar", find_newline_scalar, find_last_newline_scalar, count_newlines_scalar,
+      leading_space_scalar, trailing_space_scalar, find_literal_scalar },
+#ifdef HAVE_X86_SIMD
+    { "sse2", find_newline_sse2, find_last_newline_sse2, count_newlines_sse2,
+      leading_space_sse2, trailing_space_sse2, find_literal_sse2 },
+    { "avx2", find_newline_avx2, find_last_newline_avx2, count_newlines_avx2,
+      leading_space_avx2, trailing_space_avx2, find_literal_avx2 },
+    { "avx512", find_newline_avx512, find_last_newline_avx512, count_newlines_avx512,
+      leading_space_avx512, trailing_space_avx512, find_literal_avx512 },
+#endif
+};
+#define SCAN_KERNEL_COUNT (sizeof(scan_kernel_table) / sizeof(scan_kernel_table[0]))
+
+const ScanKernels* scan_kernels() {
+    static const ScanKernels *selected = NULL;
+    if (selected) return selected;
+    
+    size_t best = 0;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    best = 1;
+    if (__builtin_cpu_supports("avx2")) best = 2;
+    if (__builtin_cpu_supports("avx512bw")) best = 3;
+#endif
+    
+    const char *forced = getenv("COPY_SIMD");
+    for (size_t i = 0; forced && i <= best; i++) {
+        if (strcmp(forced, scan_kernel_table[i].name) == 0) best = i;
+    }
+    
+    selected = &scan_kernel_table[best];
+    return selected;
+}
 
 // Clipboard functions (platform-specific)
 #ifdef _WIN32
-bool copy_to_clipboard_win(const char *text) {
+bool copy_to_clipboard_win(const Buffer *content) {
     if (!OpenClipboard(NULL)) {
         fprintf(stderr, "Failed to open clipboard\n");
         return false;
@@ -42,15 +779,15 @@ bool copy_to_clipboard_win(const char *text) {
     
     EmptyClipboard();
     
-    size_t len = strlen(text) + 1;
-    HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, len);
+    HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, content->len + 1);
     if (!hMem) {
         CloseClipboard();
         return false;
     }
     
     char *ptr = (char*)GlobalLock(hMem);
-    strcpy(ptr, text);
+    memcpy(ptr, content->ptr, content->len);
+    ptr[content->len] = '\0';
     GlobalUnlock(hMem);
     
     SetClipboardData(CF_TEXT, hMem);
@@ -60,474 +797,4754 @@ bool copy_to_clipboard_win(const char *text) {
     return true;
 }
 
-char* paste_from_clipboard_win() {
+bool paste_from_clipboard_win(Buffer *out) {
     if (!OpenClipboard(NULL)) {
         fprintf(stderr, "Failed to open clipboard\n");
-        return NULL;
+        return false;
     }
     
     HANDLE hData = GetClipboardData(CF_TEXT);
     if (!hData) {
         CloseClipboard();
-        return NULL;
+        return false;
     }
     
     char *ptr = (char*)GlobalLock(hData);
     if (!ptr) {
         CloseClipboard();
-        return NULL;
+        return false;
     }
     
-    size_t len = strlen(ptr);
-    char *result = malloc(len + 1);
-    if (result) {
-        strcpy(result, ptr);
-    }
+    // CF_TEXT is NUL-terminated by definition
+    bool success = buffer_append(out, ptr, strlen(ptr));
     
     GlobalUnlock(hData);
     CloseClipboard();
     
-    return result;
+    return success;
+}
+
+bool clip_reader_open_win(ClipReader *r) {
+    return paste_from_clipboard_win(&r->data);
 }
 #else
-bool copy_to_clipboard_unix(const char *text) {
-    // Try xclip first
-    FILE *proc = popen("xclip -selection clipboard 2>/dev/null", "w");
-    if (proc) {
-        fwrite(text, 1, strlen(text), proc);
-        int status = pclose(proc);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            return true;
+// Pid of the most recently forked selection owner, 0 if none was started.
+// The daemon watches it to know whether the selection is still its own.
+static pid_t selection_owner_pid = 0;
+
+// Close every inherited descriptor above stderr except keep, so a forked
+// owner does not pin its parent's sockets and files for its whole lifetime
+void close_inherited_fds(int keep) {
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            int fd = atoi(entry->d_name);
+            if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir)) close(fd);
         }
+        closedir(dir);
+        return;
     }
-    
-    // Try xsel as fallback
-    proc = popen("xsel --clipboard --input 2>/dev/null", "w");
-    if (proc) {
-        fwrite(text, 1, strlen(text), proc);
-        int status = pclose(proc);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            return true;
-        }
+#endif
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+    for (int fd = STDERR_FILENO + 1; fd < max_fd; fd++) {
+        if (fd != keep) close(fd);
     }
-    
-    return false;
 }
 
-char* paste_from_clipboard_unix() {
-    char *result = NULL;
-    size_t size = 0;
-    FILE *proc;
+// Fork a background process that keeps serving the selection after the CLI
+// exits, the way xclip does. The child takes ownership first and reports the
+// outcome through a pipe, so the parent never touches the display connection.
+bool run_selection_owner(bool (*acquire)(void *ctx), void (*serve)(void *ctx), void *ctx) {
+    STATS_SPAN(PHASE_SPAWN);
+    int status_pipe[2];
+    if (pipe(status_pipe) != 0) return false;
     
-    // Try xclip first
-    proc = popen("xclip -selection clipboard -o 2>/dev/null", "r");
-    if (!proc) {
-        // Try xsel as fallback
-        proc = popen("xsel --clipboard --output 2>/dev/null", "r");
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        return false;
     }
     
-    if (proc) {
-        char buffer[1024];
-        while (fgets(buffer, sizeof(buffer), proc)) {
-            size_t len = strlen(buffer);
-            result = realloc(result, size + len + 1);
-            if (!result) {
-                pclose(proc);
-                return NULL;
-            }
-            strcpy(result + size, buffer);
-            size += len;
+    if (pid == 0) {
+        close_inherited_fds(status_pipe[1]);
+        char ok = acquire(ctx) ? 1 : 0;
+        if (write(status_pipe[1], &ok, 1) != 1 || !ok) _exit(1);
+        close(status_pipe[1]);
+        
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO) close(null_fd);
         }
-        pclose(proc);
+        serve(ctx);
+        _exit(0);
     }
     
-    return result;
+    close(status_pipe[1]);
+    char ok = 0;
+    ssize_t n;
+    do {
+        n = read(status_pipe[0], &ok, 1);
+    } while (n < 0 && errno == EINTR);
+    close(status_pipe[0]);
+    
+    if (n != 1 || !ok) {
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    selection_owner_pid = pid;
+    return true;
 }
-#endif
 
-// Cross-platform clipboard wrappers
-bool copy_to_clipboard(const char *text) {
-    if (!text) return false;
+#ifdef __linux__
+// Native Wayland backend for compositors implementing ext-data-control-v1 or
+// wlr-data-control-unstable-v1. The handful of requests involved are encoded
+// directly on the wire, so no libwayland or generated protocol code is
+// needed. Content moves through the pipe fd the compositor hands over.
+#define WL_TIMEOUT_MS 2000
+#define WL_MAX_FDS 16
+#define WL_MAX_OFFERS 8
+#define WL_DISPLAY_ID 1
+
+// Opcodes shared by both data-control protocol families
+enum {
+    WL_DISPLAY_SYNC = 0, WL_DISPLAY_GET_REGISTRY = 1,
+    WL_DISPLAY_ERROR = 0,
+    WL_REGISTRY_BIND = 0, WL_REGISTRY_GLOBAL = 0,
+    WL_CALLBACK_DONE = 0,
+    DC_MANAGER_CREATE_SOURCE = 0, DC_MANAGER_GET_DEVICE = 1,
+    DC_DEVICE_SET_SELECTION = 0,
+    DC_DEVICE_DATA_OFFER = 0, DC_DEVICE_SELECTION = 1, DC_DEVICE_FINISHED = 2,
+    DC_SOURCE_OFFER = 0, DC_SOURCE_SEND = 0, DC_SOURCE_CANCELLED = 1,
+    DC_OFFER_RECEIVE = 0, DC_OFFER_OFFER = 0
+};
+
+// Text MIME types, most preferred first
+static const char *wl_text_types[] = {
+    "text/plain;charset=utf-8", "UTF8_STRING", "text/plain", "STRING", "TEXT"
+};
+#define WL_TEXT_TYPE_COUNT (sizeof(wl_text_types) / sizeof(wl_text_types[0]))
+
+typedef struct {
+    uint32_t id;
+    unsigned types;  // Bit i set when wl_text_types[i] is offered
+} WlOffer;
+
+typedef struct {
+    int fd;
+    uint32_t next_id;
+    char in[8192];
+    size_t in_len;
+    int fds[WL_MAX_FDS];
+    int fd_count;
+    bool failed;
     
-#ifdef _WIN32
-    return copy_to_clipboard_win(text);
-#else
-    return copy_to_clipboard_unix(text);
-#endif
-}
+    uint32_t registry;
+    uint32_t callback;
+    bool callback_done;
+    uint32_t seat_name;
+    uint32_t manager_name;
+    const char *manager_iface;
+    uint32_t device;
+    uint32_t source;
+    
+    WlOffer offers[WL_MAX_OFFERS];
+    int next_offer;
+    uint32_t selection;
+    
+    const char *data;  // Content being served (owner side)
+    size_t len;
+    bool cancelled;
+} WlSession;
 
-char* paste_from_clipboard() {
-#ifdef _WIN32
-    return paste_from_clipboard_win();
-#else
-    return paste_from_clipboard_unix();
-#endif
+bool wayland_available() {
+    const char *display = getenv("WAYLAND_DISPLAY");
+    return display && *display;
 }
 
-// User confirmation utility
-bool get_user_confirmation(const char *prompt, bool default_no) {
-    printf("%s [%s/%s]: ", prompt, default_no ? "y" : "Y", default_no ? "N" : "n");
-    fflush(stdout);
+bool wl_connect(WlSession *wl) {
+    const char *display = getenv("WAYLAND_DISPLAY");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
     
-    char response[256];
-    if (!fgets(response, sizeof(response), stdin)) {
-        return false;  // EOF or error
+    int n;
+    if (display[0] == '/') {
+        n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", display);
+    } else {
+        if (!runtime) return false;
+        n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", runtime, display);
     }
+    if (n < 0 || (size_t)n >= sizeof(addr.sun_path)) return false;
     
-    // Trim newline
-    response[strcspn(response, "\n")] = 0;
-    
-    if (strlen(response) == 0) {
-        // User just pressed Enter - use default
-        return !default_no;
+    wl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (wl->fd < 0) return false;
+    if (connect(wl->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(wl->fd);
+        wl->fd = -1;
+        return false;
     }
-    
-    // Check for yes/no
-    char first_char = tolower(response[0]);
-    return (first_char == 'y');
-}
-
-// File utilities
-bool file_exists(const char *path) {
-    struct stat st;
-    return stat(path, &st) == 0;
+    wl->next_id = WL_DISPLAY_ID + 1;
+    return true;
 }
 
-bool is_regular_file(const char *path) {
-    struct stat st;
-    if (stat(path, &st) != 0) return false;
-    return S_ISREG(st.st_mode);
+void wl_disconnect(WlSession *wl) {
+    for (int i = 0; i < wl->fd_count; i++) close(wl->fds[i]);
+    wl->fd_count = 0;
+    if (wl->fd >= 0) close(wl->fd);
+    wl->fd = -1;
 }
 
-bool is_file_empty(const char *path) {
-    struct stat st;
-    if (stat(path, &st) != 0) return false;
-    return st.st_size == 0;
+// Append a wire-format string (length incl. NUL, then padded bytes)
+size_t wl_put_string(uint32_t *args, size_t n, const char *str) {
+    uint32_t len = strlen(str) + 1;
+    args[n++] = len;
+    memset(&args[n], 0, (len + 3) & ~3u);
+    memcpy(&args[n], str, len);
+    return n + (len + 3) / 4;
 }
 
-off_t get_file_size(const char *path) {
-    struct stat st;
-    if (stat(path, &st) != 0) return -1;
-    return st.st_size;
+bool wl_send(WlSession *wl, uint32_t object, uint32_t opcode, const uint32_t *args,
+             size_t nargs, int pass_fd) {
+    uint32_t header[2] = { object, (uint32_t)((8 + nargs * 4) << 16) | opcode };
+    struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void *)args, nargs * 4 }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nargs ? 2 : 1;
+    
+    char control[CMSG_SPACE(sizeof(int))];
+    if (pass_fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    
+    size_t total = sizeof(header) + nargs * 4;
+    ssize_t sent;
+    do {
+        sent = sendmsg(wl->fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent != (ssize_t)total) {
+        wl->failed = true;
+        return false;
+    }
+    return true;
 }
 
-char* get_human_readable_size(off_t bytes) {
-    static char buffer[32];
-    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
-    int unit = 0;
-    double size = bytes;
+uint32_t wl_new_id(WlSession *wl) {
+    return wl->next_id++;
+}
+
+bool wl_bind(WlSession *wl, uint32_t name, const char *iface, uint32_t version, uint32_t id) {
+    uint32_t args[32];
+    size_t n = 0;
+    args[n++] = name;
+    n = wl_put_string(args, n, iface);
+    args[n++] = version;
+    args[n++] = id;
+    return wl_send(wl, wl->registry, WL_REGISTRY_BIND, args, n, -1);
+}
+
+// Extract a string argument; NULL when malformed
+const char* wl_get_string(const uint32_t *args, size_t nwords, size_t *pos) {
+    if (*pos >= nwords) return NULL;
+    uint32_t len = args[(*pos)++];
+    size_t words = (len + 3) / 4;
+    if (len == 0 || *pos + words > nwords) return NULL;
+    const char *str = (const char *)&args[*pos];
+    if (str[len - 1] != '\0') return NULL;
+    *pos += words;
+    return str;
+}
+
+void wl_serve_send(WlSession *wl, int fd);
+
+void wl_handle_event(WlSession *wl, uint32_t object, uint32_t opcode,
+                     const uint32_t *args, size_t nwords) {
+    size_t pos = 0;
     
-    while (size >= 1024 && unit < 4) {
-        size /= 1024;
-        unit++;
+    if (object == WL_DISPLAY_ID) {
+        if (opcode == WL_DISPLAY_ERROR) wl->failed = true;
+    } else if (object == wl->registry && opcode == WL_REGISTRY_GLOBAL && nwords >= 1) {
+        uint32_t name = args[pos++];
+        const char *iface = wl_get_string(args, nwords, &pos);
+        if (!iface) return;
+        if (strcmp(iface, "wl_seat") == 0 && !wl->seat_name) {
+            wl->seat_name = name;
+        } else if (strcmp(iface, "ext_data_control_manager_v1") == 0) {
+            wl->manager_name = name;
+            wl->manager_iface = "ext_data_control_manager_v1";
+        } else if (strcmp(iface, "zwlr_data_control_manager_v1") == 0 && !wl->manager_name) {
+            wl->manager_name = name;
+            wl->manager_iface = "zwlr_data_control_manager_v1";
+        }
+    } else if (object == wl->callback && opcode == WL_CALLBACK_DONE) {
+        wl->callback_done = true;
+    } else if (object == wl->device && wl->device) {
+        if (opcode == DC_DEVICE_DATA_OFFER && nwords >= 1) {
+            WlOffer *offer = &wl->offers[wl->next_offer++ % WL_MAX_OFFERS];
+            offer->id = args[0];
+            offer->types = 0;
+        } else if (opcode == DC_DEVICE_SELECTION && nwords >= 1) {
+            wl->selection = args[0];
+        } else if (opcode == DC_DEVICE_FINISHED) {
+            wl->cancelled = true;
+        }
+    } else if (object == wl->source && wl->source) {
+        if (opcode == DC_SOURCE_SEND) {
+            if (wl->fd_count == 0) return;
+            int fd = wl->fds[0];
+            memmove(wl->fds, wl->fds + 1, --wl->fd_count * sizeof(int));
+            wl_serve_send(wl, fd);
+            close(fd);
+        } else if (opcode == DC_SOURCE_CANCELLED) {
+            wl->cancelled = true;
+        }
+    } else if (opcode == DC_OFFER_OFFER) {
+        for (int i = 0; i < WL_MAX_OFFERS; i++) {
+            if (wl->offers[i].id != object || !object) continue;
+            const char *mime = wl_get_string(args, nwords, &pos);
+            for (size_t t = 0; mime && t < WL_TEXT_TYPE_COUNT; t++) {
+                if (strcmp(mime, wl_text_types[t]) == 0) wl->offers[i].types |= 1u << t;
+            }
+        }
     }
-    
-    snprintf(buffer, sizeof(buffer), "%.1f %s", size, units[unit]);
-    return buffer;
 }
 
-char* read_file(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "Error opening file '%s': %s\n", path, strerror(errno));
-        return NULL;
+// Read whatever the compositor sent (waiting up to timeout_ms) and dispatch
+// every complete message. Returns false on timeout, EOF or protocol error.
+bool wl_dispatch(WlSession *wl, int timeout_ms) {
+    struct pollfd pfd = { wl->fd, POLLIN, 0 };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) return false;
+    
+    char control[CMSG_SPACE(sizeof(int) * WL_MAX_FDS)];
+    struct iovec iov = { wl->in + wl->in_len, sizeof(wl->in) - wl->in_len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    ssize_t n;
+    do {
+        n = recvmsg(wl->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        wl->failed = true;
+        return false;
     }
+    wl->in_len += n;
     
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *passed = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++) {
+            if (wl->fd_count < WL_MAX_FDS) {
+                wl->fds[wl->fd_count++] = passed[i];
+            } else {
+                close(passed[i]);
+            }
+        }
+    }
     
-    if (size > MAX_FILE_SIZE) {
-        fprintf(stderr, "File too large: %s (max: %s)\n", 
-                get_human_readable_size(size), 
-                get_human_readable_size(MAX_FILE_SIZE));
-        fclose(file);
-        return NULL;
+    size_t pos = 0;
+    while (wl->in_len - pos >= 8) {
+        uint32_t header[2];
+        memcpy(header, wl->in + pos, sizeof(header));
+        size_t size = header[1] >> 16;
+        if (size < 8 || size > sizeof(wl->in)) {
+            wl->failed = true;
+            return false;
+        }
+        if (wl->in_len - pos < size) break;
+        
+        uint32_t args[sizeof(wl->in) / 4];
+        memcpy(args, wl->in + pos + 8, size - 8);
+        wl_handle_event(wl, header[0], header[1] & 0xffff, args, (size - 8) / 4);
+        pos += size;
     }
+    memmove(wl->in, wl->in + pos, wl->in_len - pos);
+    wl->in_len -= pos;
     
-    char *content = malloc(size + 1);
-    if (!content) {
-        fclose(file);
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
+    return !wl->failed;
+}
+
+// Block until the compositor has processed every request sent so far
+bool wl_roundtrip(WlSession *wl) {
+    wl->callback = wl_new_id(wl);
+    wl->callback_done = false;
+    if (!wl_send(wl, WL_DISPLAY_ID, WL_DISPLAY_SYNC, &wl->callback, 1, -1)) return false;
+    while (!wl->callback_done) {
+        if (!wl_dispatch(wl, WL_TIMEOUT_MS)) return false;
+    }
+    return true;
+}
+
+// Connect, bind the seat and data-control manager, and create a data device
+bool wl_open(WlSession *wl) {
+    wl->fd = -1;
+    if (!wl_connect(wl)) return false;
+    
+    wl->registry = wl_new_id(wl);
+    if (!wl_send(wl, WL_DISPLAY_ID, WL_DISPLAY_GET_REGISTRY, &wl->registry, 1, -1) ||
+        !wl_roundtrip(wl) || !wl->seat_name || !wl->manager_name) {
+        wl_disconnect(wl);
+        return false;
     }
     
-    size_t bytes_read = fread(content, 1, size, file);
-    content[bytes_read] = '\0';
-    fclose(file);
+    uint32_t seat = wl_new_id(wl);
+    uint32_t manager = wl_new_id(wl);
+    wl->device = wl_new_id(wl);
+    uint32_t device_args[2] = { wl->device, seat };
+    if (!wl_bind(wl, wl->seat_name, "wl_seat", 1, seat) ||
+        !wl_bind(wl, wl->manager_name, wl->manager_iface, 1, manager) ||
+        !wl_send(wl, manager, DC_MANAGER_GET_DEVICE, device_args, 2, -1)) {
+        wl_disconnect(wl);
+        return false;
+    }
     
-    return content;
+    if (wl->data) {
+        wl->source = wl_new_id(wl);
+        if (!wl_send(wl, manager, DC_MANAGER_CREATE_SOURCE, &wl->source, 1, -1)) {
+            wl_disconnect(wl);
+            return false;
+        }
+    }
+    return true;
 }
 
-bool write_to_file(const char *path, const char *content, bool overwrite, bool force) {
-    bool file_exists_already = file_exists(path);
+// Hand the content to a paste client. vmsplice(2) lends our pages to the
+// pipe instead of copying them; non-pipe fds get ordinary writes.
+void wl_serve_send(WlSession *wl, int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
     
-    if (file_exists_already && !overwrite && !force) {
-        off_t size = get_file_size(path);
-        if (size == 0) {
-            printf("Note: File '%s' exists but is empty. Overwriting.\n", path);
-        } else {
-            printf("Warning: File '%s' already exists (%s).\n", 
-                   path, get_human_readable_size(size));
-            if (!get_user_confirmation("Do you want to overwrite it?", true)) {
-                printf("Operation cancelled.\n");
-                return false;
+    size_t done = 0;
+    bool use_vmsplice = true;
+    while (done < wl->len) {
+        ssize_t n;
+        if (use_vmsplice) {
+            struct iovec iov = { (void *)(wl->data + done), wl->len - done };
+            n = vmsplice(fd, &iov, 1, 0);
+            if (n < 0 && (errno == EBADF || errno == EINVAL)) {
+                use_vmsplice = false;
+                continue;
             }
+        } else {
+            n = write(fd, wl->data + done, wl->len - done);
         }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;  // Reader went away
+        }
+        done += n;
     }
+}
+
+bool wl_acquire(void *ctx) {
+    WlSession *wl = ctx;
+    if (!wl_open(wl)) return false;
     
-    // Create directory if it doesn't exist
-    char dir_path[MAX_PATH_LENGTH];
-    strncpy(dir_path, path, sizeof(dir_path) - 1);
-    dir_path[sizeof(dir_path) - 1] = '\0';
+    for (size_t t = 0; t < WL_TEXT_TYPE_COUNT; t++) {
+        uint32_t args[16];
+        size_t n = wl_put_string(args, 0, wl_text_types[t]);
+        if (!wl_send(wl, wl->source, DC_SOURCE_OFFER, args, n, -1)) return false;
+    }
+    if (!wl_send(wl, wl->device, DC_DEVICE_SET_SELECTION, &wl->source, 1, -1)) return false;
+    return wl_roundtrip(wl) && !wl->cancelled;
+}
+
+void wl_serve(void *ctx) {
+    WlSession *wl = ctx;
+    signal(SIGPIPE, SIG_IGN);
+    while (!wl->cancelled && (wl_dispatch(wl, -1) || !wl->failed)) {
+    }
+    wl_disconnect(wl);
+}
+
+bool copy_to_clipboard_wayland(const Buffer *content) {
+    WlSession wl;
+    memset(&wl, 0, sizeof(wl));
+    wl.data = content->ptr ? content->ptr : "";
+    wl.len = content->len;
+    return run_selection_owner(wl_acquire, wl_serve, &wl);
+}
+
+// Ask the selection owner to write into a pipe we pass along. The read end
+// becomes the reader's fd; the connection stays open until it is drained.
+bool clip_reader_open_wayland(ClipReader *r) {
+    WlSession wl;
+    memset(&wl, 0, sizeof(wl));
+    if (!wl_open(&wl)) return false;
     
-    // Extract directory
-    char *last_sep = strrchr(dir_path, PATH_SEPARATOR);
-    if (last_sep) {
-        *last_sep = '\0';
-        
-        // Create directory if needed
-#ifdef _WIN32
-        if (strlen(dir_path) > 0) {
-            CreateDirectoryA(dir_path, NULL);
-        }
-#else
-        if (strlen(dir_path) > 0) {
-            mkdir(dir_path, 0755);
+    // The device reports the current selection right after creation
+    if (!wl_roundtrip(&wl)) {
+        wl_disconnect(&wl);
+        return false;
+    }
+    
+    const char *mime = NULL;
+    for (int i = 0; i < WL_MAX_OFFERS && !mime && wl.selection; i++) {
+        if (wl.offers[i].id != wl.selection) continue;
+        for (size_t t = 0; t < WL_TEXT_TYPE_COUNT && !mime; t++) {
+            if (wl.offers[i].types & (1u << t)) mime = wl_text_types[t];
         }
-#endif
+    }
+    if (!mime) {
+        // An empty clipboard is not an error; one with nothing textual is
+        wl_disconnect(&wl);
+        return !wl.selection;
     }
     
-    FILE *file = fopen(path, "wb");
-    if (!file) {
-        fprintf(stderr, "Error creating file '%s': %s\n", path, strerror(errno));
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        wl_disconnect(&wl);
         return false;
     }
+    uint32_t args[16];
+    size_t n = wl_put_string(args, 0, mime);
+    bool sent = wl_send(&wl, wl.selection, DC_OFFER_RECEIVE, args, n, pipe_fds[1]);
+    close(pipe_fds[1]);
     
-    size_t len = strlen(content);
-    size_t written = fwrite(content, 1, len, file);
-    fclose(file);
+    if (!sent) {
+        close(pipe_fds[0]);
+        wl_disconnect(&wl);
+        return false;
+    }
     
-    return written == len;
+    r->fd = pipe_fds[0];
+    r->conn_fd = wl.fd;
+    wl.fd = -1;
+    wl_disconnect(&wl);
+    return true;
+}
+#endif
+
+#ifdef HAVE_XCB
+// Native X11 backend: owns CLIPBOARD in-process instead of going through
+// /bin/sh and xclip, and converts the selection directly for paste.
+// Payloads larger than one request are served with the ICCCM INCR protocol.
+#define X11_TIMEOUT_MS 2000
+#define X11_MAX_TRANSFERS 16
+#define X11_MAX_CHUNK (1024 * 1024)
+#define X11_READ_WORDS (X11_MAX_CHUNK / 4)
+
+enum {
+    X11_CLIPBOARD,
+    X11_TARGETS,
+    X11_UTF8_STRING,
+    X11_TEXT,
+    X11_TEXT_PLAIN,
+    X11_TEXT_PLAIN_UTF8,
+    X11_INCR,
+    X11_PROPERTY,
+    X11_ATOM_COUNT
+};
+
+static const char *x11_atom_names[X11_ATOM_COUNT] = {
+    "CLIPBOARD", "TARGETS", "UTF8_STRING", "TEXT",
+    "text/plain", "text/plain;charset=utf-8", "INCR", "COPY_SELECTION"
+};
+
+// One in-flight INCR transfer to a requestor window
+typedef struct {
+    xcb_window_t requestor;
+    xcb_atom_t property;
+    xcb_atom_t type;
+    size_t offset;
+    bool active;
+} X11Transfer;
+
+typedef struct {
+    xcb_connection_t *conn;
+    xcb_window_t window;
+    xcb_atom_t atoms[X11_ATOM_COUNT];
+    size_t chunk;       // Largest property written in one request
+    const char *data;   // Content being served (owner side)
+    size_t len;
+    X11Transfer transfers[X11_MAX_TRANSFERS];
+} X11Session;
+
+bool x11_available() {
+    const char *display = getenv("DISPLAY");
+    return display && *display;
 }
 
-bool append_to_file(const char *path, const char *content) {
-    FILE *file = fopen(path, "ab");
-    if (!file) {
-        fprintf(stderr, "Error opening file '%s': %s\n", path, strerror(errno));
+bool x11_open(X11Session *x) {
+    int screen_num = 0;
+    x->conn = xcb_connect(NULL, &screen_num);
+    if (xcb_connection_has_error(x->conn)) {
+        xcb_disconnect(x->conn);
+        x->conn = NULL;
         return false;
     }
     
-    // Check if file already has content (size > 0)
-    bool file_has_content = false;
-    long current_size = 0;
-    
-    // Get current file size
-    FILE *temp = fopen(path, "rb");
-    if (temp) {
-        fseek(temp, 0, SEEK_END);
-        current_size = ftell(temp);
-        fclose(temp);
-        file_has_content = (current_size > 0);
+    xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(x->conn));
+    for (; screen_num > 0 && it.rem; screen_num--) {
+        xcb_screen_next(&it);
     }
+    if (!it.rem) {
+        xcb_disconnect(x->conn);
+        x->conn = NULL;
+        return false;
+    }
+    xcb_screen_t *screen = it.data;
     
-    size_t total_written = 0;
+    x->window = xcb_generate_id(x->conn);
+    uint32_t events = XCB_EVENT_MASK_PROPERTY_CHANGE;
+    xcb_create_window(x->conn, XCB_COPY_FROM_PARENT, x->window, screen->root,
+                      0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+                      screen->root_visual, XCB_CW_EVENT_MASK, &events);
     
-    // If file has content, add a newline first
-    if (file_has_content) {
-        const char *newline = "\n";
-        size_t written = fwrite(newline, 1, 1, file);
-        if (written != 1) {
-            fclose(file);
-            return false;
+    xcb_intern_atom_cookie_t cookies[X11_ATOM_COUNT];
+    for (int i = 0; i < X11_ATOM_COUNT; i++) {
+        cookies[i] = xcb_intern_atom(x->conn, 0, strlen(x11_atom_names[i]), x11_atom_names[i]);
+    }
+    bool ok = true;
+    for (int i = 0; i < X11_ATOM_COUNT; i++) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(x->conn, cookies[i], NULL);
+        if (!reply) {
+            ok = false;
+            continue;
         }
-        total_written += written;
+        x->atoms[i] = reply->atom;
+        free(reply);
+    }
+    if (!ok) {
+        xcb_disconnect(x->conn);
+        x->conn = NULL;
+        return false;
+    }
+    
+    // Keep well below the request limit; bigger payloads go through INCR
+    size_t max_request = (size_t)xcb_get_maximum_request_length(x->conn) * 4;
+    x->chunk = max_request > 4096 ? (max_request - 1024) / 2 : 1024;
+    if (x->chunk > X11_MAX_CHUNK) x->chunk = X11_MAX_CHUNK;
+    
+    return true;
+}
+
+void x11_close(X11Session *x) {
+    if (x->conn) {
+        xcb_disconnect(x->conn);
+        x->conn = NULL;
+    }
+}
+
+// Wait for the next event; NULL on timeout or a broken connection
+xcb_generic_event_t* x11_wait_event(xcb_connection_t *conn, int timeout_ms) {
+    for (;;) {
+        xcb_generic_event_t *event = xcb_poll_for_event(conn);
+        if (event) return event;
+        if (xcb_connection_has_error(conn)) return NULL;
+        
+        struct pollfd pfd = { xcb_get_file_descriptor(conn), POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == 0) return NULL;
+        if (ready < 0 && errno != EINTR) return NULL;
     }
+}
+
+// ICCCM forbids CurrentTime for SetSelectionOwner: obtain a real server
+// timestamp from a zero-length property append on our own window.
+bool x11_server_time(X11Session *x, xcb_timestamp_t *time) {
+    xcb_change_property(x->conn, XCB_PROP_MODE_APPEND, x->window, x->atoms[X11_PROPERTY],
+                        XCB_ATOM_STRING, 8, 0, NULL);
+    xcb_flush(x->conn);
     
-    // Now append the actual content
-    size_t len = strlen(content);
-    size_t written = fwrite(content, 1, len, file);
-    total_written += written;
+    xcb_generic_event_t *event;
+    while ((event = x11_wait_event(x->conn, X11_TIMEOUT_MS))) {
+        if ((event->response_type & ~0x80) == XCB_PROPERTY_NOTIFY) {
+            xcb_property_notify_event_t *notify = (xcb_property_notify_event_t *)event;
+            if (notify->window == x->window) {
+                *time = notify->time;
+                free(event);
+                return true;
+            }
+        }
+        free(event);
+    }
+    return false;
+}
+
+bool x11_acquire(void *ctx) {
+    X11Session *x = ctx;
+    if (!x11_open(x)) return false;
     
-    fclose(file);
+    xcb_timestamp_t time;
+    if (!x11_server_time(x, &time)) return false;
     
-    return written == len;
+    xcb_set_selection_owner(x->conn, x->window, x->atoms[X11_CLIPBOARD], time);
+    xcb_get_selection_owner_reply_t *reply = xcb_get_selection_owner_reply(
+        x->conn, xcb_get_selection_owner(x->conn, x->atoms[X11_CLIPBOARD]), NULL);
+    bool owned = reply && reply->owner == x->window;
+    free(reply);
+    return owned;
 }
 
-bool delete_file_content(const char *path, bool force) {
-    if (!file_exists(path)) {
-        fprintf(stderr, "File '%s' does not exist\n", path);
-        return false;
+bool x11_is_text_target(X11Session *x, xcb_atom_t target) {
+    return target == x->atoms[X11_UTF8_STRING] || target == x->atoms[X11_TEXT] ||
+           target == x->atoms[X11_TEXT_PLAIN] || target == x->atoms[X11_TEXT_PLAIN_UTF8] ||
+           target == XCB_ATOM_STRING;
+}
+
+void x11_answer_request(X11Session *x, xcb_selection_request_event_t *req) {
+    // Obsolete clients pass None and expect the target name as property
+    xcb_atom_t property = req->property == XCB_NONE ? req->target : req->property;
+    
+    if (req->target == x->atoms[X11_TARGETS]) {
+        xcb_atom_t targets[] = {
+            x->atoms[X11_TARGETS], x->atoms[X11_UTF8_STRING], x->atoms[X11_TEXT_PLAIN_UTF8],
+            x->atoms[X11_TEXT_PLAIN], XCB_ATOM_STRING, x->atoms[X11_TEXT]
+        };
+        xcb_change_property(x->conn, XCB_PROP_MODE_REPLACE, req->requestor, property,
+                            XCB_ATOM_ATOM, 32, sizeof(targets) / sizeof(targets[0]), targets);
+    } else if (x11_is_text_target(x, req->target)) {
+        xcb_atom_t type = req->target == x->atoms[X11_TEXT] ? x->atoms[X11_UTF8_STRING] : req->target;
+        
+        if (x->len <= x->chunk) {
+            xcb_change_property(x->conn, XCB_PROP_MODE_REPLACE, req->requestor, property,
+                                type, 8, x->len, x->data);
+        } else {
+            X11Transfer *slot = NULL;
+            for (int i = 0; i < X11_MAX_TRANSFERS && !slot; i++) {
+                if (!x->transfers[i].active) slot = &x->transfers[i];
+            }
+            
+            if (slot) {
+                // Announce INCR; chunks follow each time the requestor deletes the property
+                uint32_t size_hint = x->len > UINT32_MAX ? UINT32_MAX : (uint32_t)x->len;
+                uint32_t events = XCB_EVENT_MASK_PROPERTY_CHANGE;
+                xcb_change_window_attributes(x->conn, req->requestor, XCB_CW_EVENT_MASK, &events);
+                xcb_change_property(x->conn, XCB_PROP_MODE_REPLACE, req->requestor, property,
+                                    x->atoms[X11_INCR], 32, 1, &size_hint);
+                slot->requestor = req->requestor;
+                slot->property = property;
+                slot->type = type;
+                slot->offset = 0;
+                slot->active = true;
+            } else {
+                property = XCB_NONE;
+            }
+        }
+    } else {
+        property = XCB_NONE;
     }
     
-    if (!is_regular_file(path)) {
-        fprintf(stderr, "'%s' is not a regular file\n", path);
-        return false;
+    xcb_selection_notify_event_t notify;
+    memset(&notify, 0, sizeof(notify));
+    notify.response_type = XCB_SELECTION_NOTIFY;
+    notify.time = req->time;
+    notify.requestor = req->requestor;
+    notify.selection = req->selection;
+    notify.target = req->target;
+    notify.property = property;
+    xcb_send_event(x->conn, 0, req->requestor, XCB_EVENT_MASK_NO_EVENT, (const char *)&notify);
+}
+
+void x11_continue_transfer(X11Session *x, xcb_property_notify_event_t *event) {
+    if (event->state != XCB_PROPERTY_DELETE) return;
+    
+    for (int i = 0; i < X11_MAX_TRANSFERS; i++) {
+        X11Transfer *t = &x->transfers[i];
+        if (!t->active || t->requestor != event->window || t->property != event->atom) continue;
+        
+        size_t n = x->len - t->offset;
+        if (n > x->chunk) n = x->chunk;
+        xcb_change_property(x->conn, XCB_PROP_MODE_REPLACE, t->requestor, t->property,
+                            t->type, 8, n, x->data + t->offset);
+        t->offset += n;
+        
+        // The zero-length write that ends the transfer has just been sent
+        if (n == 0) {
+            uint32_t events = XCB_EVENT_MASK_NO_EVENT;
+            xcb_change_window_attributes(x->conn, t->requestor, XCB_CW_EVENT_MASK, &events);
+            t->active = false;
+        }
+        return;
     }
+}
+
+void x11_serve(void *ctx) {
+    X11Session *x = ctx;
+    bool owner = true;
     
-    off_t size = get_file_size(path);
-    if (size == 0) {
-        printf("File '%s' is already empty.\n", path);
-        return true;
+    for (;;) {
+        bool busy = false;
+        for (int i = 0; i < X11_MAX_TRANSFERS; i++) {
+            busy = busy || x->transfers[i].active;
+        }
+        if (!owner && !busy) break;
+        
+        // Once ownership is lost, only finish transfers whose requestor is still reading
+        xcb_generic_event_t *event = owner ? xcb_wait_for_event(x->conn)
+                                           : x11_wait_event(x->conn, X11_TIMEOUT_MS);
+        if (!event) break;
+        
+        switch (event->response_type & ~0x80) {
+            case XCB_SELECTION_CLEAR:
+                owner = false;
+                break;
+            case XCB_SELECTION_REQUEST:
+                x11_answer_request(x, (xcb_selection_request_event_t *)event);
+                break;
+            case XCB_PROPERTY_NOTIFY:
+                x11_continue_transfer(x, (xcb_property_notify_event_t *)event);
+                break;
+        }
+        free(event);
+        xcb_flush(x->conn);
     }
+    x11_close(x);
+}
+
+bool copy_to_clipboard_x11(const Buffer *content) {
+    X11Session x;
+    memset(&x, 0, sizeof(x));
+    x.data = content->ptr ? content->ptr : "";
+    x.len = content->len;
+    return run_selection_owner(x11_acquire, x11_serve, &x);
+}
+
+// Read (and delete) our transfer property, appending its value to out
+bool x11_read_property(X11Session *x, xcb_atom_t *type, Buffer *out, size_t *chunk_len) {
+    uint32_t offset = 0;
+    *chunk_len = 0;
     
-    if (!force) {
-        printf("Warning: This will delete all content from '%s' (%s).\n", 
-               path, get_human_readable_size(size));
-        if (!get_user_confirmation("Do you want to continue?", true)) {
-            printf("Operation cancelled.\n");
+    for (;;) {
+        xcb_get_property_reply_t *reply = xcb_get_property_reply(x->conn,
+            xcb_get_property(x->conn, 0, x->window, x->atoms[X11_PROPERTY],
+                             XCB_GET_PROPERTY_TYPE_ANY, offset, X11_READ_WORDS), NULL);
+        if (!reply) return false;
+        
+        *type = reply->type;
+        size_t n = xcb_get_property_value_length(reply);
+        if (!buffer_append(out, xcb_get_property_value(reply), n)) {
+            free(reply);
             return false;
         }
+        *chunk_len += n;
+        offset += n / 4;
+        
+        uint32_t remaining = reply->bytes_after;
+        free(reply);
+        if (remaining == 0) break;
+    }
+    
+    xcb_delete_property(x->conn, x->window, x->atoms[X11_PROPERTY]);
+    xcb_flush(x->conn);
+    return true;
+}
+
+// Convert CLIPBOARD to text ourselves; the INCR size announcement is
+// discarded and the chunks that follow are appended until the empty one.
+bool paste_from_clipboard_x11(Buffer *out) {
+    X11Session x;
+    memset(&x, 0, sizeof(x));
+    if (!x11_open(&x)) return false;
+    
+    xcb_atom_t targets[] = { x.atoms[X11_UTF8_STRING], x.atoms[X11_TEXT_PLAIN_UTF8], XCB_ATOM_STRING };
+    size_t start = out->len;
+    bool done = false;
+    
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]) && !done; i++) {
+        xcb_convert_selection(x.conn, x.window, x.atoms[X11_CLIPBOARD], targets[i],
+                              x.atoms[X11_PROPERTY], XCB_CURRENT_TIME);
+        xcb_flush(x.conn);
+        
+        xcb_atom_t property = XCB_NONE;
+        bool notified = false;
+        xcb_generic_event_t *event;
+        while (!notified && (event = x11_wait_event(x.conn, X11_TIMEOUT_MS))) {
+            if ((event->response_type & ~0x80) == XCB_SELECTION_NOTIFY) {
+                property = ((xcb_selection_notify_event_t *)event)->property;
+                notified = true;
+            }
+            free(event);
+        }
+        if (!notified) break;          // No owner answered
+        if (property == XCB_NONE) continue;  // Target refused, try the next one
+        
+        xcb_atom_t type;
+        size_t chunk_len;
+        if (!x11_read_property(&x, &type, out, &chunk_len)) break;
+        
+        if (type == x.atoms[X11_INCR]) {
+            out->len = start;
+            for (;;) {
+                event = x11_wait_event(x.conn, X11_TIMEOUT_MS);
+                if (!event) break;
+                
+                bool new_value = (event->response_type & ~0x80) == XCB_PROPERTY_NOTIFY &&
+                    ((xcb_property_notify_event_t *)event)->state == XCB_PROPERTY_NEW_VALUE &&
+                    ((xcb_property_notify_event_t *)event)->atom == x.atoms[X11_PROPERTY];
+                free(event);
+                if (!new_value) continue;
+                
+                if (!x11_read_property(&x, &type, out, &chunk_len)) break;
+                if (chunk_len == 0) {
+                    done = true;
+                    break;
+                }
+            }
+            break;
+        }
+        done = true;
+    }
+    
+    x11_close(&x);
+    if (!done) out->len = start;
+    return done;
+}
+#endif
+
+// Clipboard backends
+// Every way of reaching a clipboard is a ClipBackendInfo: whole-buffer
+// copy, a reader (which may stream), a writer that content can be piped
+// into, and capability bits saying how the backend may be used. Helpers
+// are started with posix_spawnp: no /bin/sh in between, and a missing
+// binary is reported by the spawn itself instead of by a shell exiting 127.
+// `--backend NAME` or COPY_BACKEND picks one; otherwise the CLIP_CAP_AUTO
+// ones are probed in table order.
+typedef enum {
+    CLIP_BACKEND_NONE = -1,
+    CLIP_BACKEND_WAYLAND,
+    CLIP_BACKEND_X11,
+    CLIP_BACKEND_XCLIP,
+    CLIP_BACKEND_XSEL,
+    CLIP_BACKEND_FILE,
+    CLIP_BACKEND_SHM,
+    CLIP_BACKEND_COUNT
+} ClipBackend;
+
+enum {
+    CLIP_CAP_AUTO = 1 << 0,          // Probed when no backend is selected
+    CLIP_CAP_STREAM_WRITE = 1 << 1,  // Content can be piped in (open_writer)
+    CLIP_CAP_HEADLESS = 1 << 2,      // Host-local, needs no display; never cached
+};
+
+// Where streamed content goes: a helper's stdin or a staged file
+typedef struct {
+    int fd;
+    pid_t pid;                          // Helper reading fd, or -1
+    char path[MAX_PATH_LENGTH];         // Published on commit (file backend)
+    char temp_path[MAX_PATH_LENGTH];
+} ClipWriter;
+
+typedef struct {
+    const char *name;
+    unsigned caps;
+    bool (*usable)(ClipBackend b);                      // Worth trying in this session
+    bool (*copy)(ClipBackend b, const Buffer *content); // NULL: through the writer
+    bool (*open_reader)(ClipBackend b, ClipReader *r);
+    bool (*open_writer)(ClipBackend b, ClipWriter *w);
+    bool (*close_writer)(ClipWriter *w, bool commit);   // True if the content landed
+    const char *copy_argv[5];                           // Helper command lines
+    const char *paste_argv[5];
+} ClipBackendInfo;
+
+static const ClipBackendInfo clip_backends[CLIP_BACKEND_COUNT];
+static ClipBackend selected_backend = CLIP_BACKEND_NONE;
+
+// Map a --backend/COPY_BACKEND name; "auto" clears the selection
+bool parse_backend(const char *name, ClipBackend *out) {
+    if (strcmp(name, "auto") == 0) {
+        *out = CLIP_BACKEND_NONE;
+        return true;
+    }
+    for (int b = 0; b < CLIP_BACKEND_COUNT; b++) {
+        if (strcmp(name, clip_backends[b].name) == 0) {
+            *out = (ClipBackend)b;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Start a helper with our end of a pipe as *fd: connected to its stdin when
+// to_helper, else to its stdout. stderr goes to /dev/null. Returns the pid,
+// or -1 when the program could not be started.
+pid_t helper_spawn(const char *const argv[], bool to_helper, int *fd) {
+    STATS_SPAN(PHASE_SPAWN);
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    int ours = to_helper ? fds[1] : fds[0];
+    int theirs = to_helper ? fds[0] : fds[1];
+    fcntl(ours, F_SETFD, FD_CLOEXEC);  // Later helpers must not hold it open
+    
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, theirs, to_helper ? STDIN_FILENO : STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, theirs);
+    // Copy helpers that fork to serve the selection would otherwise hold our
+    // stdout open, and a pipeline reading it would never see EOF
+    if (to_helper) posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(theirs);
+    if (rc != 0) {
+        close(ours);
+        return -1;
+    }
+    *fd = ours;
+    return pid;
+}
+
+// Close our end of the pipe (if still open) and reap the helper;
+// true when it exited successfully
+bool helper_finish(pid_t pid, int fd) {
+    STATS_SPAN(PHASE_WAIT);
+    if (fd >= 0) close(fd);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Read the next chunk of a reader's pipe into its data buffer.
+// Returns the number of bytes read, 0 at EOF, -1 on error.
+ssize_t clip_reader_fill(ClipReader *r) {
+    if (r->fd < 0 || r->eof) return 0;
+    if (!buffer_reserve(&r->data, BUFFER_SIZE)) return -1;
+    
+    ssize_t n;
+    do {
+        n = read(r->fd, r->data.ptr + r->data.len, r->data.capacity - r->data.len - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) r->data.len += n;
+    if (n == 0) r->eof = true;
+    return n;
+}
+
+bool backend_always(ClipBackend b) {
+    (void)b;
+    return true;
+}
+
+bool backend_never(ClipBackend b) {
+    (void)b;
+    return false;
+}
+
+// The X helpers fail without a display; skipping them lets a headless
+// session reach the file backend
+bool backend_has_display(ClipBackend b) {
+    (void)b;
+    const char *display = getenv("DISPLAY");
+    return display && *display;
+}
+
+#ifdef __linux__
+bool wayland_backend_usable(ClipBackend b) {
+    (void)b;
+    return wayland_available();
+}
+
+bool wayland_backend_copy(ClipBackend b, const Buffer *content) {
+    (void)b;
+    return copy_to_clipboard_wayland(content);
+}
+
+bool wayland_backend_open_reader(ClipBackend b, ClipReader *r) {
+    (void)b;
+    return clip_reader_open_wayland(r);
+}
+#endif
+
+#ifdef HAVE_XCB
+bool x11_backend_usable(ClipBackend b) {
+    (void)b;
+    return x11_available();
+}
+
+bool x11_backend_copy(ClipBackend b, const Buffer *content) {
+    (void)b;
+    return copy_to_clipboard_x11(content);
+}
+
+bool x11_backend_open_reader(ClipBackend b, ClipReader *r) {
+    (void)b;
+    return paste_from_clipboard_x11(&r->data);
+}
+#endif
+
+// xclip / xsel: content is piped through the helper's stdin or stdout
+bool helper_open_writer(ClipBackend b, ClipWriter *w) {
+    w->pid = helper_spawn(clip_backends[b].copy_argv, true, &w->fd);
+    return w->pid >= 0;
+}
+
+bool helper_close_writer(ClipWriter *w, bool commit) {
+    return helper_finish(w->pid, w->fd) && commit;
+}
+
+bool helper_open_reader(ClipBackend b, ClipReader *r) {
+    r->pid = helper_spawn(clip_backends[b].paste_argv, false, &r->fd);
+    if (r->pid < 0) return false;
+    r->eof = false;
+    
+    // A helper that produced output is the one; one that produced nothing
+    // is only trusted if it also exited cleanly (an empty clipboard)
+    ssize_t n = clip_reader_fill(r);
+    if (n > 0) return true;
+    
+    bool exited_ok = helper_finish(r->pid, r->fd);
+    r->pid = -1;
+    r->fd = -1;
+    r->eof = true;
+    return n == 0 && exited_ok;
+}
+
+// Resolve a per-user data file: $env overrides, else $XDG_DATA_HOME/copy/name
+// or ~/.local/share/copy/name. Directories are created when asked.
+bool copy_data_path(char *path, size_t size, const char *env, const char *name, bool create) {
+    const char *file = getenv(env);
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    int n;
+    if (file && *file) {
+        n = snprintf(path, size, "%s", file);
+    } else if (data_home && *data_home) {
+        n = snprintf(path, size, "%s/copy/%s", data_home, name);
+    } else if (home && *home) {
+        n = snprintf(path, size, "%s/.local/share/copy/%s", home, name);
+    } else {
+        return false;
+    }
+    if (n < 0 || (size_t)n >= size) return false;
+    
+    for (char *sep = strchr(path + 1, '/'); create && sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        mkdir(path, 0700);  // Existing directories are fine
+        *sep = '/';
+    }
+    return true;
+}
+
+// File backend: the clip is a plain file ($COPY_CLIPBOARD_FILE, default
+// ~/.local/share/copy/clipboard, shared with the Rust port). Copies are
+// staged next to it and renamed over it, so readers never see half a clip;
+// pastes stream straight from it.
+bool file_backend_open_writer(ClipBackend b, ClipWriter *w) {
+    (void)b;
+    if (!copy_data_path(w->path, sizeof(w->path), "COPY_CLIPBOARD_FILE", "clipboard", true)) return false;
+    int n = snprintf(w->temp_path, sizeof(w->temp_path), "%s.XXXXXX", w->path);
+    if (n < 0 || (size_t)n >= sizeof(w->temp_path)) return false;
+    w->fd = mkstemp(w->temp_path);
+    if (w->fd < 0) return false;
+    fcntl(w->fd, F_SETFD, FD_CLOEXEC);
+    w->pid = -1;
+    return true;
+}
+
+bool file_backend_close_writer(ClipWriter *w, bool commit) {
+    bool success = close(w->fd) == 0 && commit && rename(w->temp_path, w->path) == 0;
+    if (!success) unlink(w->temp_path);
+    return success;
+}
+
+bool file_backend_open_reader(ClipBackend b, ClipReader *r) {
+    (void)b;
+    char path[MAX_PATH_LENGTH];
+    if (!copy_data_path(path, sizeof(path), "COPY_CLIPBOARD_FILE", "clipboard", false)) return false;
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0) return false;
+    r->eof = false;
+    return clip_reader_fill(r) >= 0;
+}
+
+// Shared-memory backend: the clip lives in a POSIX shm object
+// ($COPY_SHM_NAME, default /copy-clip-<uid>) behind a seqlock. Writers
+// serialise on flock, make seq odd, copy the content in and make it even
+// again; readers copy it out of their mapping and retry if seq moved
+// (waiting on the lock while seq is odd), so a paste on the same host
+// costs no syscalls beyond opening and mapping the object. The object only
+// ever grows, so a mapping stays valid while another process enlarges it.
+#define SHM_CLIP_MAGIC "COPYSHM1"
+
+typedef struct {
+    char magic[8];
+    uint64_t seq;       // Odd while a writer is mid-update
+    uint64_t len;       // Bytes of content after the header
+} ShmClipHeader;
+
+void shm_clip_name(char *name, size_t size) {
+    const char *env = getenv("COPY_SHM_NAME");
+    if (env && *env) {
+        snprintf(name, size, "%s", env);
+    } else {
+        snprintf(name, size, "/copy-clip-%u", (unsigned)getuid());
+    }
+}
+
+bool shm_backend_copy(ClipBackend b, const Buffer *content) {
+    (void)b;
+    char name[256];
+    shm_clip_name(name, sizeof(name));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    size_t size = sizeof(ShmClipHeader) + content->len;
+    bool ok = flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 && st.st_uid == getuid() &&
+              ((size_t)st.st_size >= size || ftruncate(fd, (off_t)size) == 0);
+    if (ok && (size_t)st.st_size > size) size = (size_t)st.st_size;
+    
+    ShmClipHeader *hdr = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (hdr != MAP_FAILED) {
+        if (memcmp(hdr->magic, SHM_CLIP_MAGIC, sizeof(hdr->magic)) != 0) {
+            hdr->seq = 0;
+            hdr->len = 0;
+            memcpy(hdr->magic, SHM_CLIP_MAGIC, sizeof(hdr->magic));
+        }
+        uint64_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) | 1;  // Heal a crashed writer
+        __atomic_store_n(&hdr->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (content->len) memcpy(hdr + 1, content->ptr, content->len);
+        __atomic_store_n(&hdr->len, (uint64_t)content->len, __ATOMIC_RELAXED);
+        __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELEASE);
+        munmap(hdr, size);
+    }
+    close(fd);  // Drops the lock
+    return hdr != MAP_FAILED;
+}
+
+bool shm_backend_open_reader(ClipBackend b, ClipReader *r) {
+    (void)b;
+    char name[256];
+    shm_clip_name(name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    void *map = MAP_FAILED;
+    size_t map_len = 0;
+    bool ok = false;
+    for (;;) {
+        bool fresh = map == MAP_FAILED;
+        if (fresh) {
+            if (fstat(fd, &st) != 0 || st.st_uid != getuid() || (size_t)st.st_size < sizeof(ShmClipHeader)) break;
+            map_len = (size_t)st.st_size;
+            map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) break;
+            if (memcmp(map, SHM_CLIP_MAGIC, sizeof(((ShmClipHeader *)0)->magic)) != 0) break;
+        }
+        const ShmClipHeader *hdr = map;
+        uint64_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+        uint64_t len = __atomic_load_n(&hdr->len, __ATOMIC_RELAXED);
+        
+        if (seq & 1) {
+            // Writer busy: sleep on its lock instead of spinning. Still odd
+            // once we hold the lock means it died mid-update, and what it
+            // left behind is torn.
+            if (flock(fd, LOCK_SH) != 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            bool torn = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE) & 1;
+            flock(fd, LOCK_UN);
+            if (torn) break;
+            continue;
+        }
+        if (len > map_len - sizeof(*hdr)) {
+            // The content outgrew our mapping, or the object is corrupt
+            if (fresh) break;
+            munmap(map, map_len);
+            map = MAP_FAILED;
+            continue;
+        }
+        
+        r->data.len = 0;
+        if (!buffer_reserve(&r->data, len)) break;
+        memcpy(r->data.ptr, hdr + 1, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq) {
+            r->data.len = len;
+            ok = true;
+            break;
+        }
+    }
+    if (map != MAP_FAILED) munmap(map, map_len);
+    close(fd);
+    return ok;
+}
+
+static const ClipBackendInfo clip_backends[CLIP_BACKEND_COUNT] = {
+#ifdef __linux__
+    { "wayland", CLIP_CAP_AUTO, wayland_backend_usable, wayland_backend_copy,
+      wayland_backend_open_reader, NULL, NULL, { NULL }, { NULL } },
+#else
+    { "wayland", CLIP_CAP_AUTO, backend_never, NULL, NULL, NULL, NULL, { NULL }, { NULL } },
+#endif
+#ifdef HAVE_XCB
+    { "x11", CLIP_CAP_AUTO, x11_backend_usable, x11_backend_copy,
+      x11_backend_open_reader, NULL, NULL, { NULL }, { NULL } },
+#else
+    { "x11", CLIP_CAP_AUTO, backend_never, NULL, NULL, NULL, NULL, { NULL }, { NULL } },
+#endif
+    { "xclip", CLIP_CAP_AUTO | CLIP_CAP_STREAM_WRITE, backend_has_display, NULL,
+      helper_open_reader, helper_open_writer, helper_close_writer,
+      { "xclip", "-selection", "clipboard", NULL }, { "xclip", "-selection", "clipboard", "-o", NULL } },
+    { "xsel", CLIP_CAP_AUTO | CLIP_CAP_STREAM_WRITE, backend_has_display, NULL,
+      helper_open_reader, helper_open_writer, helper_close_writer,
+      { "xsel", "--clipboard", "--input", NULL }, { "xsel", "--clipboard", "--output", NULL } },
+    { "file", CLIP_CAP_AUTO | CLIP_CAP_STREAM_WRITE | CLIP_CAP_HEADLESS, backend_always, NULL,
+      file_backend_open_reader, file_backend_open_writer, file_backend_close_writer, { NULL }, { NULL } },
+    { "shm", CLIP_CAP_HEADLESS, backend_always, shm_backend_copy,
+      shm_backend_open_reader, NULL, NULL, { NULL }, { NULL } },
+};
+
+// Say so when an automatic copy or paste lands on a host-local backend
+void clip_backend_note(ClipBackend b, const char *verb) {
+    if (selected_backend == CLIP_BACKEND_NONE && (clip_backends[b].caps & CLIP_CAP_HEADLESS)) {
+        fprintf(stderr, "⚠ No display clipboard available; %s the %s backend\n", verb, clip_backends[b].name);
+    }
+}
+
+// Whether b can be tried in this build and session at all
+bool clip_backend_usable(ClipBackend b) {
+    return clip_backends[b].usable(b);
+}
+
+// The backend that worked last is remembered per display, so later runs go
+// straight to it instead of re-probing the ones that failed. The cache lives
+// in $XDG_RUNTIME_DIR (or /tmp), keyed by WAYLAND_DISPLAY and DISPLAY.
+// Display names may be absolute socket paths; flatten one to a file name part
+void backend_cache_key(const char *display, char *key, size_t size) {
+    snprintf(key, size, "%s", display ? display : "");
+    for (char *c = key; *c; c++) {
+        if (*c == '/') *c = '_';
+    }
+}
+
+bool backend_cache_path(char *path, size_t size) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char wayland[MAX_PATH_LENGTH], x11[MAX_PATH_LENGTH];
+    backend_cache_key(getenv("WAYLAND_DISPLAY"), wayland, sizeof(wayland));
+    backend_cache_key(getenv("DISPLAY"), x11, sizeof(x11));
+    int n;
+    if (runtime && *runtime) {
+        n = snprintf(path, size, "%s/copy-backend.%s.%s", runtime, wayland, x11);
+    } else {
+        n = snprintf(path, size, "/tmp/copy-backend-%u.%s.%s", (unsigned)getuid(), wayland, x11);
+    }
+    return n >= 0 && (size_t)n < size;
+}
+
+ClipBackend backend_cache_load() {
+    char path[MAX_PATH_LENGTH];
+    if (!backend_cache_path(path, sizeof(path))) return CLIP_BACKEND_NONE;
+    
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return CLIP_BACKEND_NONE;
+    char name[32];
+    struct stat st;
+    ssize_t n = -1;
+    if (fstat(fd, &st) == 0 && st.st_uid == getuid()) n = read(fd, name, sizeof(name) - 1);
+    close(fd);
+    if (n <= 0) return CLIP_BACKEND_NONE;
+    
+    name[n] = '\0';
+    name[strcspn(name, "\n")] = '\0';
+    for (int b = 0; b < CLIP_BACKEND_COUNT; b++) {
+        if (strcmp(name, clip_backends[b].name) == 0) return (ClipBackend)b;
+    }
+    return CLIP_BACKEND_NONE;
+}
+
+// Replace the cache atomically; losing a race to another shell is harmless
+void backend_cache_store(ClipBackend b) {
+    // A fallback that worked says nothing about the display backends
+    if (selected_backend != CLIP_BACKEND_NONE || (clip_backends[b].caps & CLIP_CAP_HEADLESS)) return;
+    char path[MAX_PATH_LENGTH], tmp[MAX_PATH_LENGTH];
+    if (!backend_cache_path(path, sizeof(path))) return;
+    int n = snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) return;
+    
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return;
+    Buffer line = buffer_view(clip_backends[b].name, strlen(clip_backends[b].name));
+    bool written = buffer_write_fd(&line, fd);
+    if (close(fd) == 0 && written && rename(tmp, path) == 0) return;
+    unlink(tmp);
+}
+
+// Backends to try: the selected one alone, else the automatic ones with the
+// cached one first. Returns how many were stored.
+size_t clip_backend_order(ClipBackend order[CLIP_BACKEND_COUNT], ClipBackend cached) {
+    if (selected_backend != CLIP_BACKEND_NONE) {
+        order[0] = selected_backend;
+        return 1;
+    }
+    size_t n = 0;
+    if (cached != CLIP_BACKEND_NONE && clip_backend_usable(cached)) order[n++] = cached;
+    for (int b = 0; b < CLIP_BACKEND_COUNT; b++) {
+        if (b != cached && (clip_backends[b].caps & CLIP_CAP_AUTO) && clip_backend_usable((ClipBackend)b)) {
+            order[n++] = (ClipBackend)b;
+        }
+    }
+    return n;
+}
+
+// Copy a whole buffer through b, piping it into the writer when the
+// backend has no copy of its own
+bool clip_backend_copy(ClipBackend b, const Buffer *content) {
+    const ClipBackendInfo *info = &clip_backends[b];
+    if (info->copy) return info->copy(b, content);
+    if (!info->open_writer) return false;
+    
+    ClipWriter w;
+    if (!info->open_writer(b, &w)) return false;
+    // A helper that exits early must not kill us with SIGPIPE
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    bool written = buffer_write_fd(content, w.fd);
+    bool success = info->close_writer(&w, written);
+    signal(SIGPIPE, old_sigpipe);
+    return success;
+}
+
+// Try backends[0..count) in turn; the one that accepts content is cached
+bool copy_with_backends(const ClipBackend *backends, size_t count, ClipBackend cached,
+                        const Buffer *content) {
+    for (size_t i = 0; i < count; i++) {
+        if (clip_backend_copy(backends[i], content)) {
+            if (backends[i] != cached) backend_cache_store(backends[i]);
+            clip_backend_note(backends[i], "copied to");
+            return true;
+        }
+    }
+    return false;
+}
+
+bool copy_to_clipboard_unix(const Buffer *content) {
+    ClipBackend cached = backend_cache_load();
+    ClipBackend order[CLIP_BACKEND_COUNT];
+    size_t count = clip_backend_order(order, cached);
+    return copy_with_backends(order, count, cached, content);
+}
+
+#ifdef __linux__
+// Kernel-side ways to move data between two fds, best first
+typedef enum {
+    MOVE_COPY_FILE_RANGE,  // File to file; the filesystem may share extents
+    MOVE_SENDFILE,         // File to anything (sockets, devices)
+    MOVE_SPLICE,           // Either end a pipe
+} KernelMove;
+
+ssize_t kernel_move(KernelMove how, int in_fd, off_t *off, int out_fd) {
+    switch (how) {
+    case MOVE_COPY_FILE_RANGE:
+        return copy_file_range(in_fd, off, out_fd, NULL, SPLICE_CHUNK, 0);
+    case MOVE_SENDFILE:
+        return sendfile(out_fd, in_fd, off, SPLICE_CHUNK);
+    default:
+        return splice(in_fd, off, out_fd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    }
+}
+#endif
+
+// Move everything from in_fd into out_fd in fixed-size chunks. When off is
+// non-NULL the source is read positionally and its file offset is left alone.
+// The data stays in the kernel where possible: copy_file_range(2) between
+// regular files, sendfile(2) from a file to a socket or device, splice(2)
+// when either end is a pipe. Terminals, and pairs the kernel refuses, get a
+// read/write loop through one stack buffer.
+// Returns the number of bytes moved, or -1 on error.
+ssize_t stream_fd(int in_fd, off_t *off, int out_fd) {
+    STATS_SPAN(PHASE_STREAM);
+    size_t total = 0;
+    
+#ifdef __linux__
+    struct stat in_st, out_st;
+    // Files reporting size 0 (procfs and the like) must be read for real
+    bool in_file = fstat(in_fd, &in_st) == 0 && S_ISREG(in_st.st_mode) && in_st.st_size > 0;
+    bool out_known = fstat(out_fd, &out_st) == 0;
+    bool out_file = out_known && S_ISREG(out_st.st_mode);
+    bool out_pipe = out_known && S_ISFIFO(out_st.st_mode);
+    
+    KernelMove moves[3];
+    int count = 0;
+    if (!isatty(out_fd)) {
+        if (in_file && out_file) moves[count++] = MOVE_COPY_FILE_RANGE;
+        if (in_file && !out_pipe) moves[count++] = MOVE_SENDFILE;
+        moves[count++] = MOVE_SPLICE;
+    }
+    
+    for (int m = 0; m < count; m++) {
+        ssize_t n;
+        for (;;) {
+            n = kernel_move(moves[m], in_fd, off, out_fd);
+            if (n > 0) {
+                stats_add(&stats.bytes_streamed, n);
+                total += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        if (n == 0) return total;
+        
+        // Not supported for this pair (O_APPEND targets, cross-device, ...): next
+        if (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP &&
+            !(errno == EBADF && moves[m] == MOVE_COPY_FILE_RANGE)) {
+            return -1;
+        }
+    }
+#endif
+    
+    char chunk[BUFFER_SIZE];
+    for (;;) {
+        ssize_t n = off ? pread(in_fd, chunk, sizeof(chunk), *off)
+                        : read(in_fd, chunk, sizeof(chunk));
+        if (n == 0) return total;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (off) *off += n;
+        
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(out_fd, chunk + done, n - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            done += w;
+        }
+        stats_add(&stats.bytes_streamed, n);
+        total += n;
+    }
+}
+
+// pread exactly len bytes at offset; false on error or premature EOF
+bool pread_full(int fd, char *dst, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, dst, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Clipboard history
+// Every clip that reaches the clipboard is also appended to a fixed-size ring
+// file, $XDG_DATA_HOME/copy/history (~/.local/share/copy/history), mapped
+// MAP_SHARED: a header, an index of HISTORY_ENTRIES slots, then a data region
+// written circularly. Offsets are logical and only grow, so a clip stays
+// intact until data_size more bytes have been written after it; old clips
+// are never rewritten, only eventually overrun. Appends hold an exclusive
+// flock and readers a shared one. COPY_NO_HISTORY=1 turns recording off.
+#define HISTORY_ENTRIES 256
+#define HISTORY_DATA_SIZE ((uint64_t)64 * 1024 * 1024)
+#define HISTORY_MAGIC "COPYHIS1"
+
+typedef struct {
+    char magic[8];
+    uint32_t entries;      // Index slots
+    uint32_t data_offset;  // File offset of the data region (page aligned)
+    uint64_t data_size;
+    uint64_t count;        // Clips ever appended; clip i lives in slot i % entries
+    uint64_t head;         // Logical end of the data region
+} HistoryHeader;
+
+typedef struct {
+    uint64_t offset;  // Logical; the bytes are at data + offset % data_size
+    uint64_t len;
+    int64_t time;
+    uint64_t hash;
+} HistoryEntry;
+
+typedef struct {
+    int fd;              // Holds the flock for as long as it is open
+    char *map;
+    size_t map_len;
+    HistoryHeader *header;
+    HistoryEntry *index;
+    char *data;
+} History;
+
+// FNV-1a constants over 8-byte words, cheap enough to run on every clip
+uint64_t history_hash(const char *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+    for (; i < len; i++) h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Resolve the history file ($COPY_HISTORY_FILE overrides), creating its
+// directories when asked
+bool history_path(char *path, size_t size, bool create) {
+    return copy_data_path(path, size, "COPY_HISTORY_FILE", "history", create);
+}
+
+bool history_header_valid(const HistoryHeader *hdr, off_t file_size) {
+    return memcmp(hdr->magic, HISTORY_MAGIC, sizeof(hdr->magic)) == 0 &&
+           hdr->entries > 0 && hdr->entries <= 65536 && hdr->data_size > 0 &&
+           hdr->data_offset >= sizeof(HistoryHeader) + (uint64_t)hdr->entries * sizeof(HistoryEntry) &&
+           (uint64_t)hdr->data_offset + hdr->data_size <= (uint64_t)file_size;
+}
+
+void history_close(History *h) {
+    if (h->map) munmap(h->map, h->map_len);
+    if (h->fd >= 0) close(h->fd);
+    h->map = NULL;
+    h->fd = -1;
+}
+
+// Open and lock the ring (exclusively when writable). A missing or
+// unrecognised file is laid out afresh by writers; readers give up.
+bool history_open(History *h, bool writable) {
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+    if (getenv("COPY_NO_HISTORY")) return false;
+    
+    char path[MAX_PATH_LENGTH];
+    if (!history_path(path, sizeof(path), writable)) return false;
+    h->fd = writable ? open(path, O_RDWR | O_CREAT, 0600) : open(path, O_RDONLY);
+    if (h->fd < 0) return false;
+    fcntl(h->fd, F_SETFD, FD_CLOEXEC);
+    
+    int locked;
+    do {
+        locked = flock(h->fd, writable ? LOCK_EX : LOCK_SH);
+    } while (locked != 0 && errno == EINTR);
+    
+    HistoryHeader hdr;
+    struct stat st;
+    if (locked != 0 || fstat(h->fd, &st) != 0) {
+        history_close(h);
+        return false;
+    }
+    bool valid = st.st_size >= (off_t)sizeof(hdr) && pread_full(h->fd, (char *)&hdr, sizeof(hdr), 0) &&
+                 history_header_valid(&hdr, st.st_size);
+    
+    if (!valid) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t index_end = sizeof(HistoryHeader) + HISTORY_ENTRIES * sizeof(HistoryEntry);
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, HISTORY_MAGIC, sizeof(hdr.magic));
+        hdr.entries = HISTORY_ENTRIES;
+        hdr.data_offset = (index_end + page - 1) / page * page;
+        hdr.data_size = HISTORY_DATA_SIZE;
+        
+        // Sparse: disk blocks are only used as clips are written
+        if (!writable || ftruncate(h->fd, 0) != 0 ||
+            ftruncate(h->fd, hdr.data_offset + hdr.data_size) != 0 ||
+            pwrite(h->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+            history_close(h);
+            return false;
+        }
+    }
+    
+    h->map_len = hdr.data_offset + hdr.data_size;
+    h->map = mmap(NULL, h->map_len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, h->fd, 0);
+    if (h->map == MAP_FAILED) {
+        h->map = NULL;
+        history_close(h);
+        return false;
+    }
+    h->header = (HistoryHeader *)h->map;
+    h->index = (HistoryEntry *)(h->map + sizeof(HistoryHeader));
+    h->data = h->map + hdr.data_offset;
+    return true;
+}
+
+// The nth most recent clip (1 = latest) as a view into the mapping;
+// false when it was never recorded or has since been overrun
+bool history_get(const History *h, uint64_t n, Buffer *out) {
+    const HistoryHeader *hdr = h->header;
+    if (n == 0 || n > hdr->count || n > hdr->entries) return false;
+    
+    const HistoryEntry *e = &h->index[(hdr->count - n) % hdr->entries];
+    if (e->len > hdr->data_size || e->offset + e->len > hdr->head ||
+        hdr->head - e->offset > hdr->data_size) {
+        return false;
+    }
+    *out = buffer_view(h->data + e->offset % hdr->data_size, e->len);
+    return true;
+}
+
+// Claim len contiguous bytes at the head; a clip never straddles the wrap
+// point. head moves before anything is written, so clips being overrun
+// already read as gone if we die midway.
+char* history_reserve(History *h, uint64_t len, uint64_t *offset) {
+    HistoryHeader *hdr = h->header;
+    if (len > hdr->data_size) return NULL;
+    
+    uint64_t pos = hdr->head % hdr->data_size;
+    if (pos + len > hdr->data_size) hdr->head += hdr->data_size - pos;
+    *offset = hdr->head;
+    hdr->head += len;
+    return h->data + *offset % hdr->data_size;
+}
+
+// Publish a reserved clip in the next index slot, unless it repeats the
+// latest one
+void history_commit(History *h, uint64_t offset, uint64_t len) {
+    HistoryHeader *hdr = h->header;
+    uint64_t hash = history_hash(h->data + offset % hdr->data_size, len);
+    Buffer latest;
+    if (history_get(h, 1, &latest) && latest.len == len &&
+        h->index[(hdr->count - 1) % hdr->entries].hash == hash &&
+        memcmp(latest.ptr, h->data + offset % hdr->data_size, len) == 0) {
+        return;
+    }
+    
+    HistoryEntry *e = &h->index[hdr->count % hdr->entries];
+    e->offset = offset;
+    e->len = len;
+    e->time = (int64_t)time(NULL);
+    e->hash = hash;
+    hdr->count++;
+}
+
+// Record an in-memory clip; best effort, failures only skip recording
+void history_append(const Buffer *content) {
+    History h;
+    if (!history_open(&h, true)) return;
+    
+    uint64_t offset;
+    char *dst = history_reserve(&h, content->len, &offset);
+    if (dst) {
+        if (content->len > 0) memcpy(dst, content->ptr, content->len);
+        history_commit(&h, offset, content->len);
+    }
+    history_close(&h);
+}
+
+// Record len bytes of a file starting at start, read straight into the ring
+void history_append_fd(int fd, off_t start, size_t len) {
+    History h;
+    if (!history_open(&h, true)) return;
+    
+    uint64_t offset;
+    char *dst = history_reserve(&h, len, &offset);
+    if (dst && pread_full(fd, dst, len, start)) {
+        history_commit(&h, offset, len);
+    }
+    history_close(&h);
+}
+
+// Move a pipe into out_fd, recording it on the way in a private scratch
+// file that goes into the ring at EOF through history_append_fd. The ring's
+// lock is only held for that last step, never while waiting on the pipe,
+// so a slow producer cannot stall other copies or --history readers. A clip
+// outgrowing the ring is not recorded.
+ssize_t history_relay(int in_fd, int out_fd) {
+    STATS_SPAN(PHASE_STREAM);
+    int record = getenv("COPY_NO_HISTORY") ? -1 : spill_file_create();
+    if (record < 0) return stream_fd(in_fd, NULL, out_fd);
+    
+    char chunk[BUFFER_SIZE];
+    uint64_t recorded = 0;
+    ssize_t total = 0;
+    for (;;) {
+        ssize_t n = read(in_fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) total = -1;
+            break;
+        }
+        Buffer piece = buffer_view(chunk, n);
+        if (!buffer_write_fd(&piece, out_fd)) {
+            total = -1;
+            break;
+        }
+        total += n;
+        
+        if (recorded + n > HISTORY_DATA_SIZE || !buffer_write_fd(&piece, record)) {
+            // Too large, or out of scratch space: pass the rest straight on
+            close(record);
+            ssize_t rest = stream_fd(in_fd, NULL, out_fd);
+            return rest < 0 ? -1 : total + rest;
+        }
+        recorded += n;
+    }
+    
+    if (total >= 0) history_append_fd(record, 0, recorded);
+    close(record);
+    return total;
+}
+
+// Move a pipe into out_fd while keeping all of it in replay, so the next
+// backend can be fed from there if this one fails. A writer that goes away
+// does not stop the copy into replay; *delivered tells whether it got
+// everything. Returns the bytes read, or -1 when the pipe or replay failed.
+ssize_t replay_relay(int in_fd, int out_fd, int replay, bool *delivered) {
+    STATS_SPAN(PHASE_STREAM);
+    char chunk[BUFFER_SIZE];
+    bool out_open = true;
+    ssize_t total = 0;
+    for (;;) {
+        ssize_t n = read(in_fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            *delivered = out_open;
+            return total;
+        }
+        
+        Buffer piece = buffer_view(chunk, n);
+        if (!buffer_write_fd(&piece, replay)) return -1;
+        if (out_open) out_open = buffer_write_fd(&piece, out_fd);
+        total += n;
+    }
+}
+
+// Stream a file or pipe straight into the clipboard backend. Memory use is
+// bounded by one chunk regardless of input size and the helper starts
+// receiving data immediately. A seekable source is replayed into the next
+// backend if a helper fails; a pipe is kept in a spill file on its way
+// through for the same purpose, and can only be consumed once when no
+// spill file can be made.
+bool copy_stream_to_clipboard_unix(int fd, size_t *copied) {
+    ClipBackend cached = backend_cache_load();
+    ClipBackend order[CLIP_BACKEND_COUNT];
+    size_t count = clip_backend_order(order, cached);
+    
+    struct stat st;
+    bool seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    off_t start = seekable ? lseek(fd, 0, SEEK_CUR) : 0;
+    if (start < 0) {
+        seekable = false;
+        start = 0;
+    }
+    
+    // A helper that exits early must not kill us with SIGPIPE
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    bool success = false;
+    bool consumed = false;
+    int replay = -1;
+    size_t i = 0;
+    
+    // Stream into writers until reaching a backend that needs a buffer
+    for (; i < count && !success && !consumed && (clip_backends[order[i]].caps & CLIP_CAP_STREAM_WRITE); i++) {
+        const ClipBackendInfo *info = &clip_backends[order[i]];
+        ClipWriter w;
+        if (!info->open_writer(order[i], &w)) continue;
+        
+        // Files are recorded from the page cache afterwards, and so is a
+        // pipe once it is in replay; without replay it can only be recorded
+        // on the way through
+        off_t off = start;
+        ssize_t moved;
+        bool delivered = true;
+        if (seekable) {
+            moved = stream_fd(fd, &off, w.fd);
+        } else if ((replay = spill_file_create()) >= 0) {
+            moved = replay_relay(fd, w.fd, replay, &delivered);
+            fd = replay;
+            seekable = moved >= 0;  // Otherwise replay is incomplete
+        } else {
+            moved = history_relay(fd, w.fd);
+        }
+        if (info->close_writer(&w, moved >= 0 && delivered)) {
+            if (seekable) history_append_fd(fd, start, moved);
+            if (order[i] != cached) backend_cache_store(order[i]);
+            clip_backend_note(order[i], "copied to");
+            *copied = moved;
+            success = true;
+        }
+        consumed = !seekable;
+    }
+    signal(SIGPIPE, old_sigpipe);
+    
+    // In-process selection owners and shm have to hold the content themselves
+    if (!success && !consumed && i < count && (!seekable || lseek(fd, start, SEEK_SET) == start)) {
+        Buffer content;
+        buffer_init(&content);
+        success = buffer_read_fd(&content, fd) && copy_with_backends(order + i, count - i, cached, &content);
+        if (success) history_append(&content);
+        *copied = content.len;
+        buffer_free(&content);
+    }
+    if (replay >= 0) close(replay);
+    return success;
+}
+
+bool clip_reader_open_unix(ClipReader *r) {
+    ClipBackend cached = backend_cache_load();
+    ClipBackend order[CLIP_BACKEND_COUNT];
+    size_t count = clip_backend_order(order, cached);
+    
+    for (size_t i = 0; i < count; i++) {
+        if (clip_backends[order[i]].open_reader && clip_backends[order[i]].open_reader(order[i], r)) {
+            if (order[i] != cached) backend_cache_store(order[i]);
+            clip_backend_note(order[i], "pasted from");
+            return true;
+        }
+    }
+    return false;
+}
+
+// Clipboard daemon
+// `copy --daemon` keeps the latest clip in one long-lived process and serves
+// the CLI over a Unix socket, so scripted copies skip backend probing and
+// pastes of our own clip never touch the display server. Each connection
+// carries one fixed-size request; a copy either passes a source file along
+// (SCM_RIGHTS) for the daemon to read itself or streams the bytes after the
+// header. Pipes are never passed: the daemon serves one client at a time.
+// A paste is answered from memory while the selection owner forked for
+// that clip is still alive, i.e. nobody else has taken the clipboard.
+enum {
+    DAEMON_OP_COPY = 'C',
+    DAEMON_OP_PASTE = 'P',
+};
+
+enum {
+    DAEMON_REPLY_OK = 0,
+    DAEMON_REPLY_FAILED = 1,
+    DAEMON_REPLY_NOT_HELD = 2,  // Clipboard changed hands; ask the backend
+};
+
+typedef struct {
+    uint32_t op;      // DAEMON_OP_* in requests, DAEMON_REPLY_* in replies
+    uint32_t has_fd;  // Request: content comes from the attached fd
+    uint64_t len;     // Request: inline content length; reply: clip length
+} DaemonMessage;
+
+typedef enum {
+    DAEMON_UNAVAILABLE,  // No daemon running; use the direct path
+    DAEMON_FAILED,
+    DAEMON_OK,
+} DaemonResult;
+
+#define DAEMON_SEND_TIMEOUT 5  // Seconds a stalled paste client may block us
+
+// $COPY_SOCKET, else $XDG_RUNTIME_DIR/copy.sock, else /tmp/copy-<uid>.sock
+bool daemon_socket_path(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    
+    const char *path = getenv("COPY_SOCKET");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int n;
+    if (path && *path) {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+    } else if (runtime && *runtime) {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/copy.sock", runtime);
+    } else {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/copy-%u.sock", (unsigned)getuid());
+    }
+    return n > 0 && (size_t)n < sizeof(addr->sun_path);
+}
+
+// Send all of data, attaching fd (if >= 0) to the first byte
+bool daemon_send(int sock, const void *data, size_t len, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    const char *p = data;
+    
+    while (len > 0) {
+        struct iovec iov = { (void *)p, len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (fd >= 0) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        fd = -1;
+    }
+    return true;
+}
+
+// Receive exactly len bytes; a descriptor passed along is stored in *fd
+bool daemon_recv(int sock, void *data, size_t len, int *fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    char *p = data;
+    if (fd) *fd = -1;
+    
+    while (len > 0) {
+        struct iovec iov = { p, len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        ssize_t n = recvmsg(sock, &msg, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+            if (fd && *fd < 0) {
+                *fd = received;
+            } else {
+                close(received);
+            }
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Connect to a running daemon owned by us; -1 when there is none,
+// COPY_NO_DAEMON is set or a backend was chosen explicitly
+int daemon_connect() {
+    if (getenv("COPY_NO_DAEMON") || selected_backend != CLIP_BACKEND_NONE) return -1;
+    
+    struct sockaddr_un addr;
+    struct stat st;
+    if (!daemon_socket_path(&addr)) return -1;
+    if (stat(addr.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        return -1;
+    }
+    
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Hand content to the daemon: inline from content, or by passing fd.
+// *copied receives the stored length.
+DaemonResult daemon_copy(const Buffer *content, int fd, size_t *copied) {
+    int sock = daemon_connect();
+    if (sock < 0) return DAEMON_UNAVAILABLE;
+    
+    DaemonMessage req = { DAEMON_OP_COPY, fd >= 0, fd >= 0 ? 0 : content->len };
+    DaemonMessage reply;
+    bool sent = daemon_send(sock, &req, sizeof(req), fd) &&
+                (fd >= 0 || daemon_send(sock, content->ptr, content->len, -1));
+    bool ok = sent && daemon_recv(sock, &reply, sizeof(reply), NULL);
+    close(sock);
+    
+    if (!sent) return DAEMON_UNAVAILABLE;  // Daemon took nothing; go direct
+    if (!ok || reply.op != DAEMON_REPLY_OK) return DAEMON_FAILED;
+    if (copied) *copied = reply.len;
+    return DAEMON_OK;
+}
+
+// Paste through the daemon when it still owns the clipboard. The socket
+// becomes the reader's fd and carries exactly the clip.
+bool clip_reader_open_daemon(ClipReader *r) {
+    int sock = daemon_connect();
+    if (sock < 0) return false;
+    
+    DaemonMessage req = { DAEMON_OP_PASTE, 0, 0 };
+    DaemonMessage reply;
+    if (!daemon_send(sock, &req, sizeof(req), -1) ||
+        !daemon_recv(sock, &reply, sizeof(reply), NULL) ||
+        reply.op != DAEMON_REPLY_OK) {
+        close(sock);
+        return false;
+    }
+    
+    r->fd = sock;
+    r->eof = reply.len == 0;
+    if (r->eof) {
+        close(sock);
+        r->fd = -1;
+    }
+    return true;
+}
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+void daemon_handle_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// Serve one connection; clip and *owner are the daemon's state
+void daemon_serve_client(int client, Buffer *clip, pid_t *owner) {
+    DaemonMessage req, reply = { DAEMON_REPLY_FAILED, 0, 0 };
+    int fd = -1;
+    if (!daemon_recv(client, &req, sizeof(req), &fd)) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    
+    if (req.op == DAEMON_OP_COPY) {
+        Buffer incoming;
+        buffer_init(&incoming);
+        bool ok;
+        if (req.has_fd) {
+            // Clients are served one at a time, so only a descriptor that
+            // cannot block (a regular file) is read here
+            struct stat st;
+            ok = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && buffer_read_fd(&incoming, fd);
+        } else {
+            ok = req.len <= SIZE_MAX - 1 && buffer_reserve(&incoming, req.len) &&
+                 daemon_recv(client, incoming.ptr, req.len, NULL);
+            if (ok) incoming.len = req.len;
+        }
+        
+        if (ok) {
+            selection_owner_pid = 0;
+            ok = copy_to_clipboard_unix(&incoming);
+        }
+        if (ok) {
+            history_append(&incoming);
+            buffer_free(clip);
+            *clip = incoming;
+            *owner = selection_owner_pid;
+            reply.op = DAEMON_REPLY_OK;
+            reply.len = clip->len;
+        } else {
+            buffer_free(&incoming);
+        }
+        daemon_send(client, &reply, sizeof(reply), -1);
+    } else if (req.op == DAEMON_OP_PASTE) {
+        // Helper backends (xclip) daemonize themselves, so only a clip held
+        // by our own forked owner can be vouched for
+        bool held = *owner > 0 && waitpid(*owner, NULL, WNOHANG) == 0;
+        if (!held) *owner = 0;
+        reply.op = held ? DAEMON_REPLY_OK : DAEMON_REPLY_NOT_HELD;
+        reply.len = held ? clip->len : 0;
+        if (daemon_send(client, &reply, sizeof(reply), -1) && held) {
+            daemon_send(client, clip->ptr, clip->len, -1);
+        }
+    }
+    
+    if (fd >= 0) close(fd);
+}
+
+int run_daemon() {
+    struct sockaddr_un addr;
+    if (!daemon_socket_path(&addr)) {
+        fprintf(stderr, "Error: Daemon socket path too long\n");
+        return 1;
+    }
+    
+    // Refuse to replace a live daemon; a stale socket file is removed
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        close(probe);
+        fprintf(stderr, "Error: A daemon is already listening on %s\n", addr.sun_path);
+        return 1;
+    }
+    if (probe >= 0) close(probe);
+    unlink(addr.sun_path);
+    
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+        return 1;
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    mode_t old_umask = umask(077);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound != 0 || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", addr.sun_path, strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_handle_signal;  // No SA_RESTART: accept() must wake up
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    printf("Copy daemon listening on %s\n", addr.sun_path);
+    fflush(stdout);
+    
+    Buffer clip;
+    buffer_init(&clip);
+    pid_t owner = 0;
+    
+    while (!daemon_stop) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        struct timeval timeout = { DAEMON_SEND_TIMEOUT, 0 };
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        
+        daemon_serve_client(client, &clip, &owner);
+        close(client);
+        
+        // Reap owners that lost the selection, keeping the current one
+        pid_t done;
+        while ((done = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if (done == owner) owner = 0;
+        }
+    }
+    
+    close(listen_fd);
+    unlink(addr.sun_path);
+    buffer_free(&clip);
+    return 0;
+}
+#endif
+
+// Cross-platform clipboard wrappers
+bool copy_to_clipboard(const Buffer *content) {
+#ifdef _WIN32
+    return copy_to_clipboard_win(content);
+#else
+    DaemonResult result = daemon_copy(content, -1, NULL);
+    if (result != DAEMON_UNAVAILABLE) return result == DAEMON_OK;
+    if (!copy_to_clipboard_unix(content)) return false;
+    history_append(content);
+    return true;
+#endif
+}
+
+// Copy an open file or pipe without loading it into memory first
+bool copy_stream_to_clipboard(int fd, size_t *copied) {
+#ifdef _WIN32
+    Buffer content;
+    buffer_init(&content);
+    bool success = buffer_read_fd(&content, fd) && copy_to_clipboard_win(&content);
+    *copied = content.len;
+    buffer_free(&content);
+    return success;
+#else
+    // Only files go to the daemon, which reads them itself; a pipe could
+    // stall it for every other client, so pipes are streamed from here
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        DaemonResult result = daemon_copy(NULL, fd, copied);
+        if (result != DAEMON_UNAVAILABLE) return result == DAEMON_OK;
+    }
+    return copy_stream_to_clipboard_unix(fd, copied);
+#endif
+}
+
+bool clip_reader_open(ClipReader *r) {
+    clip_reader_init(r);
+#ifdef _WIN32
+    return clip_reader_open_win(r);
+#else
+    if (!clip_reader_open_daemon(r) && !clip_reader_open_unix(r)) return false;
+    // Prefetch so clip_reader_empty() is meaningful for pipe backends too
+    if (r->data.len == 0 && clip_reader_fill(r) < 0) return false;
+    return true;
+#endif
+}
+
+// Open the nth most recent history entry (1 = latest). The reader borrows
+// it straight from the mapping and keeps the shared lock until closed.
+bool clip_reader_open_history(ClipReader *r, int n) {
+    clip_reader_init(r);
+#ifdef _WIN32
+    (void)n;
+    return false;
+#else
+    History h;
+    if (!history_open(&h, false)) return false;
+    if (n <= 0 || !history_get(&h, n, &r->data)) {
+        history_close(&h);
+        return false;
+    }
+    r->backing = buffer_view(h.map, h.map_len);
+    r->backing.owner = BUFFER_MAPPED;
+    r->conn_fd = h.fd;
+    r->eof = true;
+    return true;
+#endif
+}
+
+bool clip_reader_empty(const ClipReader *r) {
+    return r->data.len == 0 && (r->fd < 0 || r->eof);
+}
+
+// Release the reader; false if a helper reported failure
+bool clip_reader_close(ClipReader *r) {
+    bool success = true;
+#ifndef _WIN32
+    if (r->pid > 0) {
+        success = helper_finish(r->pid, r->fd);
+    } else if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->conn_fd >= 0) close(r->conn_fd);
+#endif
+    buffer_free(&r->data);
+    buffer_free(&r->backing);
+    clip_reader_init(r);
+    return success;
+}
+
+// Stream the clipboard into out_fd, optionally preceded by prefix. Work is
+// linear in the content size: the prefetched part is written once and the
+// rest of the pipe is spliced into out_fd without passing through the heap.
+bool clip_reader_to_fd(ClipReader *r, int out_fd, const Buffer *prefix, size_t *pasted) {
+    *pasted = 0;
+    Buffer parts[2] = { prefix ? *prefix : buffer_view("", 0), r->data };
+    if (!buffer_writev_fd(parts, 2, out_fd)) return false;
+    *pasted = r->data.len;
+    
+#ifndef _WIN32
+    if (r->fd >= 0 && !r->eof) {
+        ssize_t moved = stream_fd(r->fd, NULL, out_fd);
+        if (moved < 0) return false;
+        *pasted += moved;
+        r->eof = true;
+    }
+#endif
+    return true;
+}
+
+// Paste the whole clipboard into memory
+bool paste_from_clipboard(Buffer *out) {
+    ClipReader r;
+    if (!clip_reader_open(&r)) {
+        clip_reader_close(&r);
+        return false;
+    }
+    
+    bool success = buffer_append(out, r.data.ptr, r.data.len);
+#ifndef _WIN32
+    if (success && r.fd >= 0 && !r.eof) {
+        success = buffer_read_fd(out, r.fd);
+    }
+#endif
+    clip_reader_close(&r);
+    return success;
+}
+
+// User confirmation utility
+bool get_user_confirmation(const char *prompt, bool default_no) {
+    printf("%s [%s/%s]: ", prompt, default_no ? "y" : "Y", default_no ? "N" : "n");
+    fflush(stdout);
+    
+    char response[256];
+    if (!fgets(response, sizeof(response), stdin)) {
+        return false;  // EOF or error
+    }
+    
+    // Trim newline
+    response[strcspn(response, "\n")] = 0;
+    
+    if (strlen(response) == 0) {
+        // User just pressed Enter - use default
+        return !default_no;
+    }
+    
+    // Check for yes/no
+    char first_char = tolower(response[0]);
+    return (first_char == 'y');
+}
+
+// File utilities
+off_t get_file_size(const char *path) {
+    STATS_SPAN(PHASE_STAT);
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    return st.st_size;
+}
+
+char* get_human_readable_size(off_t bytes) {
+    static char buffer[32];
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    double size = bytes;
+    
+    while (size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    
+    snprintf(buffer, sizeof(buffer), "%.1f %s", size, units[unit]);
+    return buffer;
+}
+
+// Parse a size argument such as "4096", "512K", "20M" or "2G".
+// Returns -1 on malformed input; 0 means "no limit".
+off_t parse_size(const char *arg) {
+    if (!arg || !isdigit((unsigned char)*arg)) return -1;
+    
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0) return -1;
+    
+    unsigned long long multiplier = 1;
+    switch (toupper((unsigned char)*end)) {
+        case '\0': break;
+        case 'K': multiplier = 1024ULL; end++; break;
+        case 'M': multiplier = 1024ULL * 1024; end++; break;
+        case 'G': multiplier = 1024ULL * 1024 * 1024; end++; break;
+        default: return -1;
+    }
+    if (toupper((unsigned char)*end) == 'B') end++;
+    if (*end != '\0') return -1;
+    
+    if (value > (unsigned long long)INT64_MAX / multiplier) return -1;
+    return (off_t)(value * multiplier);
+}
+
+// Parse a --range argument "A:B" (1-based, inclusive). Either side may be
+// left out: ":B" starts at line 1 and "A:" runs to the end of the input.
+bool parse_line_range(const char *arg, uint64_t *first, uint64_t *last) {
+    const char *colon = strchr(arg, ':');
+    if (!colon) return false;
+    
+    char *end;
+    *first = 1;
+    *last = UINT64_MAX;
+    if (colon != arg) {
+        if (!isdigit((unsigned char)*arg)) return false;
+        errno = 0;
+        *first = strtoull(arg, &end, 10);
+        if (errno != 0 || end != colon) return false;
+    }
+    if (colon[1] != '\0') {
+        if (!isdigit((unsigned char)colon[1])) return false;
+        errno = 0;
+        *last = strtoull(colon + 1, &end, 10);
+        if (errno != 0 || *end != '\0') return false;
+    }
+    return *first >= 1 && *first <= *last;
+}
+
+// File sessions
+// A file named on the command line is opened once. Everything after that
+// (type and size checks, reads, mapping, readahead hints) works on the fd,
+// so the path is looked up a single time (it matters on NFS homes) and
+// cannot be swapped between the checks and the read.
+typedef struct {
+    const char *path;
+    int fd;
+    struct stat st;
+} FileSession;
+
+// Open path with flags (O_RDONLY, O_WRONLY, ...) and fstat it. FIFOs and
+// devices are opened without blocking; callers look at st before reading.
+// Errors are reported in the wording of the checks this replaces.
+bool file_session_open(FileSession *fs, const char *path, int flags) {
+    fs->path = path;
+#ifdef O_NONBLOCK
+    fs->fd = open(path, flags | O_BINARY | O_NONBLOCK);
+#else
+    fs->fd = open(path, flags | O_BINARY);
+#endif
+    if (fs->fd < 0) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "Error: File '%s' does not exist\n", path);
+        } else {
+            fprintf(stderr, "Error opening file '%s': %s\n", path, strerror(errno));
+        }
+        return false;
+    }
+    if (fstat(fs->fd, &fs->st) != 0) {
+        fprintf(stderr, "Error reading file '%s': %s\n", path, strerror(errno));
+        close(fs->fd);
+        fs->fd = -1;
+        return false;
+    }
+#ifdef O_NONBLOCK
+    if (S_ISREG(fs->st.st_mode)) fcntl(fs->fd, F_SETFL, fcntl(fs->fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+    return true;
+}
+
+void file_session_close(FileSession *fs) {
+    if (fs->fd >= 0) close(fs->fd);
+    fs->fd = -1;
+}
+
+// Hint that the whole file is about to be read front to back
+void file_session_advise_sequential(FileSession *fs) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fs->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    (void)fs;
+}
+
+// Load the session's file for copying. Files of MMAP_THRESHOLD bytes or
+// more are mapped (MAP_PRIVATE, read-only) so the content is never
+// duplicated on the heap; smaller files, and filesystems that refuse mmap,
+// fall back to a plain read. A max_size of 0 disables the size limit.
+bool file_session_read(FileSession *fs, off_t max_size, Buffer *out) {
+    STATS_SPAN(PHASE_READ);
+    buffer_init(out);
+    off_t size = fs->st.st_size;
+    
+    if (max_size > 0 && size > max_size) {
+        fprintf(stderr, "File too large: %s", get_human_readable_size(size));
+        fprintf(stderr, " (max: %s)\n", get_human_readable_size(max_size));
+        return false;
+    }
+    
+#ifndef _WIN32
+    if (size >= MMAP_THRESHOLD) {
+        void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fs->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)size, MADV_SEQUENTIAL);
+            stats_add(&stats.bytes_mapped, (uint64_t)size);
+            out->ptr = map;
+            out->len = (size_t)size;
+            out->capacity = (size_t)size;
+            out->owner = BUFFER_MAPPED;
+            return true;
+        }
+    }
+#endif
+    
+    if (!buffer_reserve(out, (size_t)size)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    size_t done = 0;
+    while (done < (size_t)size) {
+        ssize_t n = read(fs->fd, out->ptr + done, (size_t)size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fprintf(stderr, "Error reading file '%s': %s\n", fs->path, strerror(errno));
+            buffer_free(out);
+            return false;
+        }
+        if (n == 0) break;  // Shrunk since fstat
+        done += n;
+    }
+    out->len = done;
+    stats_add(&stats.bytes_read, done);
+    return true;
+}
+
+// One-shot form for callers that only need the content
+bool read_file(const char *path, off_t max_size, Buffer *out) {
+    FileSession fs;
+    buffer_init(out);
+    if (!file_session_open(&fs, path, O_RDONLY)) return false;
+    bool success = file_session_read(&fs, max_size, out);
+    file_session_close(&fs);
+    return success;
+}
+
+// Create the directory a file is about to be written into, if needed
+void create_parent_directory(const char *path) {
+    char dir_path[MAX_PATH_LENGTH];
+    strncpy(dir_path, path, sizeof(dir_path) - 1);
+    dir_path[sizeof(dir_path) - 1] = '\0';
+    
+    // Extract directory
+    char *last_sep = strrchr(dir_path, PATH_SEPARATOR);
+    if (last_sep) {
+        *last_sep = '\0';
+        
+        // Create directory if needed
+#ifdef _WIN32
+        if (strlen(dir_path) > 0) {
+            CreateDirectoryA(dir_path, NULL);
+        }
+#else
+        if (strlen(dir_path) > 0) {
+            mkdir(dir_path, 0755);
+        }
+#endif
+    }
+}
+
+// Write engine
+// A paste never rewrites its target in place. The new content is staged in
+// an anonymous O_TMPFILE (or a hidden mkstemp file) next to the target,
+// preallocated when its size is known, and published with rename(2), so a
+// crash leaves either the old file or the new one, never half of each. The
+// target's permissions are carried over. Hard-linked and special files
+// (and directories we cannot create files in) are still written in place.
+// Appends are one O_APPEND open and one writev of separator and payload.
+typedef enum {
+    DURABILITY_NONE,  // Leave flushing to the kernel
+    DURABILITY_DATA,  // fdatasync before publishing
+    DURABILITY_FULL,  // fsync before publishing, then fsync the directory
+} Durability;
+
+static Durability output_durability = DURABILITY_NONE;  // --fsync or $COPY_FSYNC
+
+bool parse_durability(const char *arg, Durability *out) {
+    if (strcmp(arg, "none") == 0) *out = DURABILITY_NONE;
+    else if (strcmp(arg, "data") == 0) *out = DURABILITY_DATA;
+    else if (strcmp(arg, "full") == 0) *out = DURABILITY_FULL;
+    else return false;
+    return true;
+}
+
+typedef struct {
+    int fd;
+    bool staged;                      // fd is a replacement, not the target
+    char path[MAX_PATH_LENGTH];       // Target, symlinks resolved
+    char temp_path[MAX_PATH_LENGTH];  // Named staging file; empty for O_TMPFILE
+} OutputFile;
+
+#ifndef _WIN32
+// Directory part of path ("." when there is none)
+void output_dir(const char *path, char *dir, size_t size) {
+    const char *sep = strrchr(path, '/');
+    if (!sep) {
+        snprintf(dir, size, ".");
+    } else if (sep == path) {
+        snprintf(dir, size, "/");
+    } else {
+        snprintf(dir, size, "%.*s", (int)(sep - path), path);
+    }
+}
+
+// Process umask. It can only be read by setting it, which would race with
+// other writers, so it is read once, before any worker starts.
+mode_t output_umask(void) {
+    static mode_t mask = (mode_t)-1;
+    if (mask == (mode_t)-1) {
+        mask = umask(0);
+        umask(mask);
+    }
+    return mask;
+}
+
+// Create the staging file in the target's directory
+bool output_stage(OutputFile *out, mode_t mode, size_t size_hint) {
+    char dir[MAX_PATH_LENGTH];
+    output_dir(out->path, dir, sizeof(dir));
+    out->temp_path[0] = '\0';
+    
+#ifdef O_TMPFILE
+    // Anonymous until published; needs /proc to be linked in later
+    if (access("/proc/self/fd", X_OK) == 0) {
+        out->fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+    }
+#endif
+    if (out->fd < 0) {
+        const char *base = strrchr(out->path, '/');
+        base = base ? base + 1 : out->path;
+        int n = snprintf(out->temp_path, sizeof(out->temp_path), "%s/.%s.XXXXXX", dir, base);
+        if (n < 0 || (size_t)n >= sizeof(out->temp_path)) return false;
+        out->fd = mkstemp(out->temp_path);
+        if (out->fd < 0) {
+            out->temp_path[0] = '\0';
+            return false;
+        }
+    }
+    
+    fchmod(out->fd, mode);
+    out->staged = true;
+#ifdef __linux__
+    if (size_hint > 0) fallocate(out->fd, FALLOC_FL_KEEP_SIZE, 0, size_hint);
+#else
+    (void)size_hint;
+#endif
+    return true;
+}
+#endif
+
+// Open path for a paste. size_hint (0 = unknown) is used to preallocate.
+bool output_open(OutputFile *out, const char *path, bool append, size_t size_hint) {
+    memset(out, 0, sizeof(*out));
+    out->fd = -1;
+    snprintf(out->path, sizeof(out->path), "%s", path);
+    create_parent_directory(path);
+    
+#ifndef _WIN32
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (!append && (!exists || (S_ISREG(st.st_mode) && st.st_nlink == 1))) {
+        char resolved[PATH_MAX];
+        if (exists && realpath(path, resolved)) snprintf(out->path, sizeof(out->path), "%s", resolved);
+        
+        mode_t mode = exists ? (st.st_mode & 07777) : (0644 & ~output_umask());
+        if (output_stage(out, mode, size_hint)) {
+            if (exists && fchown(out->fd, st.st_uid, st.st_gid) != 0) {
+                // Only root can give the file away; keeping our own ownership is fine
+            }
+            return true;
+        }
+        snprintf(out->path, sizeof(out->path), "%s", path);
+    }
+#else
+    (void)size_hint;
+#endif
+    
+    int flags = O_WRONLY | O_CREAT | O_BINARY | (append ? O_APPEND : O_TRUNC);
+    out->fd = open(path, flags, 0644);
+    if (out->fd < 0) {
+        fprintf(stderr, "Error %s file '%s': %s\n", append ? "opening" : "creating",
+                path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Drop a paste that failed; a staged replacement leaves no trace
+void output_abort(OutputFile *out) {
+    if (out->fd >= 0) close(out->fd);
+    if (out->temp_path[0]) unlink(out->temp_path);
+    out->fd = -1;
+}
+
+// Flush as requested and publish. False (with the target untouched, when
+// staged) if anything failed.
+bool output_commit(OutputFile *out) {
+    bool ok = true;
+#ifndef _WIN32
+    if (output_durability == DURABILITY_DATA) ok = fdatasync(out->fd) == 0;
+    if (output_durability == DURABILITY_FULL) ok = fsync(out->fd) == 0;
+#endif
+    if (!out->staged) {
+        ok = close(out->fd) == 0 && ok;
+        out->fd = -1;
+        return ok;
+    }
+    
+#ifndef _WIN32
+    // An O_TMPFILE gets a name first: link it in beside the target
+    if (ok && !out->temp_path[0]) {
+        char proc_path[64], dir[MAX_PATH_LENGTH];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", out->fd);
+        output_dir(out->path, dir, sizeof(dir));
+        ok = false;
+        for (int attempt = 0; attempt < 100 && !ok; attempt++) {
+            int n = snprintf(out->temp_path, sizeof(out->temp_path), "%s/.copy.%ld.%d",
+                             dir, (long)getpid(), attempt);
+            if (n < 0 || (size_t)n >= sizeof(out->temp_path)) break;
+            ok = linkat(AT_FDCWD, proc_path, AT_FDCWD, out->temp_path, AT_SYMLINK_FOLLOW) == 0;
+            if (!ok && errno != EEXIST) break;
+        }
+        if (!ok) out->temp_path[0] = '\0';
+    }
+    
+    ok = ok && rename(out->temp_path, out->path) == 0;
+    if (!ok) {
+        int saved = errno;
+        output_abort(out);
+        errno = saved;
+        return false;
+    }
+    out->temp_path[0] = '\0';
+    ok = close(out->fd) == 0;
+    out->fd = -1;
+    
+    if (ok && output_durability == DURABILITY_FULL) {
+        char dir[MAX_PATH_LENGTH];
+        output_dir(out->path, dir, sizeof(dir));
+        int dir_fd = open(dir, O_RDONLY);
+        if (dir_fd >= 0) {
+            ok = fsync(dir_fd) == 0;
+            close(dir_fd);
+        }
+    }
+#endif
+    return ok;
+}
+
+bool write_to_file(const char *path, const Buffer *content, bool overwrite, bool force) {
+    off_t size = get_file_size(path);  // -1 when it does not exist yet
+    
+    if (size >= 0 && !overwrite && !force) {
+        if (size == 0) {
+            printf("Note: File '%s' exists but is empty. Overwriting.\n", path);
+        } else {
+            printf("Warning: File '%s' already exists (%s).\n", 
+                   path, get_human_readable_size(size));
+            if (!get_user_confirmation("Do you want to overwrite it?", true)) {
+                printf("Operation cancelled.\n");
+                return false;
+            }
+        }
+    }
+    
+    OutputFile out;
+    if (!output_open(&out, path, false, content->len)) return false;
+    if (!buffer_write_fd(content, out.fd)) {
+        fprintf(stderr, "Error writing to '%s': %s\n", path, strerror(errno));
+        output_abort(&out);
+        return false;
+    }
+    if (!output_commit(&out)) {
+        fprintf(stderr, "Error saving '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Existing content is separated from the new by a newline; both go out in
+// one write
+bool append_to_file(const char *path, const Buffer *content) {
+    OutputFile out;
+    if (!output_open(&out, path, true, 0)) return false;
+    
+    struct stat st;
+    bool file_has_content = fstat(out.fd, &st) == 0 && st.st_size > 0;
+    Buffer parts[2] = { buffer_view("\n", file_has_content ? 1 : 0), *content };
+    if (!buffer_writev_fd(parts, 2, out.fd)) {
+        fprintf(stderr, "Error writing to '%s': %s\n", path, strerror(errno));
+        output_abort(&out);
+        return false;
+    }
+    return output_commit(&out);
+}
+
+// The file is classified through a read-only open, so directories and
+// FIFOs get the regular-file error; only then is it opened for writing.
+bool delete_file_content(const char *path, bool force) {
+    FileSession fs;
+    if (!file_session_open(&fs, path, O_RDONLY)) return false;
+    
+    if (!S_ISREG(fs.st.st_mode)) {
+        fprintf(stderr, "'%s' is not a regular file\n", path);
+        file_session_close(&fs);
+        return false;
+    }
+    
+    off_t size = fs.st.st_size;
+    if (size == 0) {
+        printf("File '%s' is already empty.\n", path);
+        file_session_close(&fs);
+        return true;
+    }
+    
+    if (!force) {
+        printf("Warning: This will delete all content from '%s' (%s).\n", 
+               path, get_human_readable_size(size));
+        if (!get_user_confirmation("Do you want to continue?", true)) {
+            printf("Operation cancelled.\n");
+            file_session_close(&fs);
+            return false;
+        }
+    }
+    
+    FileSession target;
+    bool opened = file_session_open(&target, path, O_WRONLY);
+    file_session_close(&fs);
+    if (!opened) return false;
+    if (target.st.st_dev != fs.st.st_dev || target.st.st_ino != fs.st.st_ino) {
+        fprintf(stderr, "Error: '%s' was replaced while deleting its content\n", path);
+        file_session_close(&target);
+        return false;
+    }
+    
+    bool truncated = ftruncate(target.fd, 0) == 0;
+    if (!truncated) fprintf(stderr, "Error truncating file: %s\n", strerror(errno));
+    file_session_close(&target);
+    if (!truncated) return false;
+    
+    printf("All content successfully deleted from '%s'\n", path);
+    printf("Bytes freed: %s\n", get_human_readable_size(size));
+    return true;
+}
+
+// Pipe/STDIN handling
+bool read_from_stdin(Buffer *out) {
+    buffer_init(out);
+    if (!buffer_read_fd(out, fileno(stdin))) {
+        buffer_free(out);
+        return false;
+    }
+    return true;
+}
+
+// Shown whenever no clipboard backend accepted the content
+void print_clipboard_hint() {
+    fprintf(stderr, "✗ Failed to copy to clipboard\n");
+    fprintf(stderr, "You may need to install clipboard utilities:\n");
+#ifdef _WIN32
+    fprintf(stderr, "  Windows: Built-in clipboard should work\n");
+#elif __APPLE__
+    fprintf(stderr, "  macOS: Built-in clipboard should work\n");
+#else
+    fprintf(stderr, "  Linux: Install 'xclip' or 'xsel':\n");
+    fprintf(stderr, "    sudo apt-get install xclip\n");
+    fprintf(stderr, "    sudo apt-get install xsel\n");
+#endif
+}
+
+// Emit the --stats/COPY_TRACE line; registered with atexit
+void print_stats() {
+    double wall_ms = (monotonic_ns() - stats.start_ns) / 1e6;
+    fprintf(stderr, "{\"version\":\"%s\",\"wall_ms\":%.3f", VERSION, wall_ms);
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(stderr, ",\"user_ms\":%.3f,\"sys_ms\":%.3f,\"peak_rss_kb\":%ld,"
+                "\"minor_faults\":%ld,\"major_faults\":%ld,\"ctx_switches\":%ld",
+                usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+                usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3,
+                usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw + usage.ru_nivcsw);
+    }
+#endif
+    fprintf(stderr, ",\"bytes_read\":%llu,\"bytes_mapped\":%llu,\"bytes_written\":%llu,"
+            "\"bytes_streamed\":%llu,\"allocations\":%llu,\"allocated_bytes\":%llu,"
+            "\"memory_budget\":%llu,\"spilled_bytes\":%llu,\"phases\":{",
+            (unsigned long long)stats.bytes_read, (unsigned long long)stats.bytes_mapped,
+            (unsigned long long)stats.bytes_written, (unsigned long long)stats.bytes_streamed,
+            (unsigned long long)stats.allocations, (unsigned long long)stats.allocated_bytes,
+            (unsigned long long)memory_budget, (unsigned long long)stats.spilled_bytes);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(stderr, "%s\"%s\":{\"ms\":%.3f,\"calls\":%llu}", p ? "," : "", stats_phase_names[p],
+                stats.phase_ns[p] / 1e6, (unsigned long long)stats.phase_calls[p]);
+    }
+    fprintf(stderr, "}}\n");
+}
+
+// Turn instrumentation on (once) for the rest of the run
+void stats_enable() {
+    if (stats.enabled) return;
+    stats.enabled = true;
+    stats.start_ns = monotonic_ns();
+    atexit(print_stats);
+}
+
+// Help text
+void print_help() {
+    printf("Copy v%s - File/Clipboard/Pipe Utility\n", VERSION);
+    printf("===========================================\n\n");
+    printf("Usage: copy [OPTIONS] [FILE | DIR]...\n\n");
+    printf("Operations:\n");
+    printf("  -c, --copy           Copy file/content to clipboard (default)\n");
+    printf("  -p, --paste          Paste clipboard to file (or stdout if no file)\n");
+    printf("  -d, --delete         Delete file content\n");
+    printf("  -a, --append         Append to file instead of overwriting\n");
+    printf("  -s, --stdin          Read from stdin (pipe)\n");
+    printf("  -o, --stdout         Output to stdout\n");
+    printf("  -v, --version        Show version\n");
+    printf("  FILE... / DIR        Several files or directories are copied as one\n");
+    printf("                       bundle with a '==> path <==' header per file;\n");
+    printf("                       with -p, the clipboard is pasted to every FILE\n\n");
+    
+    printf("Options:\n");
+    printf("  -f, --force          Force operation without confirmation\n");
+    printf("  -n, --no-newline     Don't add newline when reading from stdin\n");
+    printf("  -b, --binary         Treat content as binary (preserve newlines)\n");
+    printf("  -l, --lines N        Copy only first N lines\n");
+    printf("  -t, --tail N         Copy only last N lines\n");
+    printf("      --range A:B      Copy only lines A to B (':B' from the start, 'A:' to\n");
+    printf("                       the end); large files keep a line index to jump in\n");
+    printf("      --line N         Copy only line N\n");
+    printf("      --grep PATTERN   Copy only lines containing PATTERN; -l/-t count\n");
+    printf("                       matching lines\n");
+    printf("      --regex          Treat the --grep PATTERN as a POSIX extended regex\n");
+    printf("      --dedupe         Drop lines that repeat the line before them\n");
+    printf("      --squeeze-blank  Collapse runs of empty lines into one\n");
+    printf("  -m, --max-size N     Maximum size in bytes, K/M/G suffixes allowed\n");
+    printf("                       (default: 100MB, 0 = no limit)\n");
+    printf("      --count-lines    Print the number of lines in FILE or stdin\n");
+    printf("      --history N      With -p, paste the Nth most recent clip (1 = latest)\n");
+    printf("      --from-list FILE With -p, also paste to each path listed in FILE\n");
+    printf("                       (one per line, '-' for stdin)\n");
+    printf("      --fsync MODE     Durability of pasted files: none, data or full\n");
+    printf("      --memory-budget N\n");
+    printf("                       Heap per capture before spilling to a temp file\n");
+    printf("                       (default: 64MB, 0 = no limit; COPY_MEMORY_BUDGET)\n");
+    printf("      --stats          Print timings per phase, bytes moved and peak memory\n");
+    printf("                       as one JSON line on stderr (also COPY_TRACE=1)\n");
+    printf("      --backend NAME   Use one clipboard backend: wayland, x11, xclip, xsel,\n");
+    printf("                       file or shm (default: auto; COPY_BACKEND)\n");
+    printf("      --tee [FILE]     Pass stdin through to stdout, capturing it to the\n");
+    printf("                       clipboard (or FILE) in constant memory\n");
+    printf("      --daemon         Serve copy/paste requests from a background daemon\n");
+    printf("                       (used automatically while running; COPY_NO_DAEMON=1\n");
+    printf("                       bypasses it)\n\n");
+    
+    printf("Exit Codes:\n");
+    printf("  0 - Success\n");
+    printf("  1 - Error\n");
+    printf("  2 - User cancelled\n");
+}
+
+// New features
+// Head: read fd incrementally and stop as soon as n newlines have been seen,
+// so `copy -l 20` costs the same on a 10 GB file as on a small one. out
+// holds at most one chunk past the selection and its length is cut to it.
+// Works on pipes too. max_size (0 = unlimited) applies to the selection.
+bool read_first_n_lines(int fd, int n, off_t max_size, Buffer *out) {
+    STATS_SPAN(PHASE_READ);
+    const ScanKernels *kernels = scan_kernels();
+    buffer_init(out);
+    size_t selected = 0;   // End of the last complete line found so far
+    int lines = 0;
+    bool too_large = false;
+    
+    while (lines < n) {
+        if (!buffer_reserve(out, BUFFER_SIZE)) {
+            buffer_free(out);
+            return false;
+        }
+        ssize_t got = read(fd, out->ptr + out->len, BUFFER_SIZE);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            buffer_free(out);
+            return false;
+        }
+        if (got == 0) {
+            selected = out->len;  // EOF: the unterminated last line counts
+            break;
+        }
+        stats_add(&stats.bytes_read, got);
+        
+        const char *scan = out->ptr + out->len;
+        const char *end = scan + got;
+        out->len += got;
+        const char *nl;
+        while (lines < n && scan < end && (nl = kernels->find_newline(scan, end - scan))) {
+            scan = nl + 1;
+            selected = scan - out->ptr;
+            lines++;
+        }
+        
+        // A line still being read counts against the limit too, so input
+        // without newlines is not read whole only to be rejected
+        too_large = max_size > 0 && (off_t)(lines < n ? out->len : selected) > max_size;
+        if (too_large) break;
+    }
+    
+    if (too_large) {
+        if (lines < n && (off_t)selected <= max_size) {
+            fprintf(stderr, "Line %d has no newline within the size limit (max: %s)\n",
+                    lines + 1, get_human_readable_size(max_size));
+        } else {
+            fprintf(stderr, "Selected lines too large (max: %s)\n", get_human_readable_size(max_size));
+        }
+        buffer_free(out);
+        return false;
+    }
+    out->len = selected;
+    return true;
+}
+
+// Tail of an in-memory buffer, returned as a borrowed view; nothing is copied
+Buffer get_last_n_lines(const Buffer *content, int n) {
+    STATS_SPAN(PHASE_TRANSFORM);
+    if (n <= 0) return buffer_slice(content, content->len, 0);
+    
+    const char *begin = content->ptr;
+    const char *end = content->ptr + content->len;
+    const char *start = end;
+    int lines = 0;
+    
+    // A trailing newline terminates the last line rather than starting a new one
+    if (start > begin && *(start - 1) == '\n') start--;
+    
+    // Go backwards to find start of last n lines
+    const ScanKernels *kernels = scan_kernels();
+    const char *nl;
+    while (start > begin && (nl = kernels->find_last_newline(begin, start - begin))) {
+        start = nl;
+        lines++;
+        if (lines == n) {
+            start++; // Move past newline
+            break;
+        }
+    }
+    
+    // If we didn't find enough newlines, start from beginning
+    if (lines < n) {
+        start = begin;
+    }
+    
+    return buffer_slice(content, start - begin, end - start);
+}
+
+// Move past up to n newlines in [p, end), counting whole blocks at a time
+// until the block holding the nth one. *found says how many were passed;
+// the result points just after the last of them (or at end).
+const char* skip_lines(const char *p, const char *end, uint64_t n, uint64_t *found) {
+    const ScanKernels *kernels = scan_kernels();
+    *found = 0;
+    while (*found < n && p < end) {
+        size_t len = end - p < BUFFER_SIZE ? (size_t)(end - p) : BUFFER_SIZE;
+        size_t lines = kernels->count_newlines(p, len);
+        if (*found + lines < n) {
+            *found += lines;
+            p += len;
+            continue;
+        }
+        const char *nl;
+        while (*found < n && (nl = kernels->find_newline(p, end - p))) {
+            p = nl + 1;
+            (*found)++;
+        }
+    }
+    return p;
+}
+
+// Lines first..last (1-based, inclusive) of an in-memory buffer as a
+// borrowed view; empty when the buffer has fewer than first lines
+Buffer get_line_range(const Buffer *content, uint64_t first, uint64_t last) {
+    STATS_SPAN(PHASE_TRANSFORM);
+    const char *end = content->ptr + content->len;
+    uint64_t found;
+    const char *start = skip_lines(content->ptr, end, first - 1, &found);
+    if (found < first - 1) start = end;
+    const char *stop = skip_lines(start, end, last - first + 1, &found);
+    return buffer_slice(content, start - content->ptr, stop - start);
+}
+
+// Count lines in fd, including a final line without a trailing newline.
+// Regular files are mapped and scanned in one pass at memory bandwidth;
+// pipes are read in SPLICE_CHUNK blocks. Nothing is kept in memory.
+bool count_lines_fd(int fd, uint64_t *count) {
+    const ScanKernels *kernels = scan_kernels();
+    *count = 0;
+    
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= MMAP_THRESHOLD &&
+        (uint64_t)st.st_size <= SIZE_MAX) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            const char *p = map;
+            *count = kernels->count_newlines(p, st.st_size);
+            if (p[st.st_size - 1] != '\n') (*count)++;
+            munmap(map, st.st_size);
+            return true;
+        }
+    }
+#endif
+    
+    char *block = malloc(SPLICE_CHUNK);
+    if (!block) return false;
+    char last = '\n';
+    for (;;) {
+        ssize_t got = read(fd, block, SPLICE_CHUNK);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            free(block);
+            return false;
+        }
+        if (got == 0) break;
+        *count += kernels->count_newlines(block, got);
+        last = block[got - 1];
+    }
+    if (last != '\n') (*count)++;
+    free(block);
+    return true;
+}
+
+#ifndef _WIN32
+// Tail without loading the file: walk fixed-size blocks backwards from EOF
+// with pread, counting newlines until n are found, then read just that
+// region. Cost depends on the size of the tail, not of the file. max_size
+// (0 = unlimited) applies to the selected lines.
+bool read_last_n_lines(int fd, int n, off_t max_size, Buffer *out) {
+    STATS_SPAN(PHASE_READ);
+    buffer_init(out);
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    off_t size = st.st_size;
+    
+    const ScanKernels *kernels = scan_kernels();
+    char block[BUFFER_SIZE];
+    off_t pos = size;
+    off_t start = 0;
+    int lines = 0;
+    
+    while (pos > 0 && lines < n) {
+        size_t len = pos >= BUFFER_SIZE ? BUFFER_SIZE : (size_t)pos;
+        pos -= len;
+        if (!pread_full(fd, block, len, pos)) return false;
+        stats_add(&stats.bytes_read, len);
+        
+        size_t scan = len;
+        // A trailing newline terminates the last line rather than starting a new one
+        if (pos + (off_t)len == size && block[len - 1] == '\n') scan--;
+        
+        const char *nl;
+        while (scan > 0 && (nl = kernels->find_last_newline(block, scan))) {
+            scan = nl - block;
+            if (++lines == n) {
+                start = pos + scan + 1;
+                break;
+            }
+        }
+    }
+    
+    size_t tail_len = size - start;
+    if (max_size > 0 && (off_t)tail_len > max_size) {
+        fprintf(stderr, "Selected lines too large: %s", get_human_readable_size(tail_len));
+        fprintf(stderr, " (max: %s)\n", get_human_readable_size(max_size));
+        return false;
+    }
+    if (!buffer_reserve(out, tail_len) || !pread_full(fd, out->ptr, tail_len, start)) {
+        buffer_free(out);
+        return false;
+    }
+    stats_add(&stats.bytes_read, tail_len);
+    out->len = tail_len;
+    return true;
+}
+
+// Line index
+// --range and --line jump into large files through a sparse index of line
+// offsets: mark k is where line k * LINE_INDEX_STRIDE + 1 starts. It is kept
+// in a sidecar per file ($COPY_LINE_INDEX_DIR, else $XDG_CACHE_HOME/copy/lines
+// or ~/.cache/copy/lines, named by device and inode) together with the size
+// and mtime it describes. A file that only grew is indexed from where the
+// sidecar stopped, after checking that the last indexed bytes are unchanged;
+// anything else is reindexed. With the marks around a range known, the range
+// costs one pread of at most two strides more than the selected lines.
+#define LINE_INDEX_STRIDE 1024
+#define LINE_INDEX_TAIL 4096  // Bytes before the indexed end checked on growth
+#define LINE_INDEX_MIN_SIZE (1024 * 1024)  // Smaller files are not worth a sidecar
+#define LINE_INDEX_MAGIC "COPYLIX1"
+
+typedef struct {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;       // Bytes indexed
+    uint64_t mtime_ns;   // mtime when they were indexed
+    uint64_t newlines;   // Newlines in the indexed bytes
+    uint64_t lines;      // Same, plus an unterminated last line
+    uint64_t tail_hash;  // history_hash of the last LINE_INDEX_TAIL indexed bytes
+    uint64_t count;      // Marks that follow the header
+} LineIndexHeader;
+
+typedef struct {
+    LineIndexHeader hdr;
+    uint64_t *marks;
+    size_t capacity;
+} LineIndex;
+
+uint64_t stat_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (uint64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+bool line_index_path(const struct stat *st, char *path, size_t size) {
+    const char *dir = getenv("COPY_LINE_INDEX_DIR");
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+    if (dir && *dir) {
+        n = snprintf(path, size, "%s/", dir);
+    } else if (cache_home && *cache_home) {
+        n = snprintf(path, size, "%s/copy/lines/", cache_home);
+    } else if (home && *home) {
+        n = snprintf(path, size, "%s/.cache/copy/lines/", home);
+    } else {
+        return false;
+    }
+    if (n < 0 || (size_t)n >= size) return false;
+    
+    for (char *sep = strchr(path + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        mkdir(path, 0700);  // Existing directories are fine
+        *sep = '/';
+    }
+    int m = snprintf(path + n, size - n, "%llx-%llx.idx",
+                     (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return m >= 0 && (size_t)m < size - n;
+}
+
+bool line_index_push(LineIndex *idx, uint64_t offset) {
+    if (idx->hdr.count == idx->capacity) {
+        size_t capacity = idx->capacity ? idx->capacity * 2 : 256;
+        uint64_t *marks = realloc(idx->marks, capacity * sizeof(*marks));
+        if (!marks) return false;
+        idx->marks = marks;
+        idx->capacity = capacity;
+    }
+    idx->marks[idx->hdr.count++] = offset;
+    return true;
+}
+
+// Start over: nothing indexed yet, line 1 at offset 0
+bool line_index_reset(LineIndex *idx, const struct stat *st) {
+    memset(&idx->hdr, 0, sizeof(idx->hdr));
+    memcpy(idx->hdr.magic, LINE_INDEX_MAGIC, sizeof(idx->hdr.magic));
+    idx->hdr.dev = st->st_dev;
+    idx->hdr.ino = st->st_ino;
+    return line_index_push(idx, 0);
+}
+
+bool line_index_tail_hash(int fd, uint64_t size, uint64_t *hash) {
+    char tail[LINE_INDEX_TAIL];
+    size_t len = size < LINE_INDEX_TAIL ? (size_t)size : LINE_INDEX_TAIL;
+    if (!pread_full(fd, tail, len, size - len)) return false;
+    *hash = history_hash(tail, len);
+    return true;
+}
+
+// Load the sidecar for the session's file. False when there is none or it
+// cannot be trusted for the file as it is now.
+bool line_index_load(LineIndex *idx, FileSession *fs, const char *path) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return false;
+    struct stat st;
+    LineIndexHeader *hdr = &idx->hdr;
+    bool ok = fstat(fd, &st) == 0 && st.st_uid == getuid() &&
+              pread_full(fd, (char *)hdr, sizeof(*hdr), 0) &&
+              memcmp(hdr->magic, LINE_INDEX_MAGIC, sizeof(hdr->magic)) == 0 &&
+              hdr->dev == (uint64_t)fs->st.st_dev && hdr->ino == (uint64_t)fs->st.st_ino &&
+              hdr->count > 0 && hdr->count <= SIZE_MAX / sizeof(uint64_t) &&
+              (uint64_t)st.st_size == sizeof(*hdr) + hdr->count * sizeof(uint64_t);
+    if (ok) {
+        idx->marks = malloc(hdr->count * sizeof(uint64_t));
+        idx->capacity = idx->marks ? hdr->count : 0;
+        ok = idx->marks && pread_full(fd, (char *)idx->marks, hdr->count * sizeof(uint64_t), sizeof(*hdr));
+    }
+    close(fd);
+    if (!ok) return false;
+    
+    uint64_t size = fs->st.st_size;
+    if (hdr->size == size && hdr->mtime_ns == stat_mtime_ns(&fs->st)) return true;
+    
+    // Appended to since: keep the marks if the indexed part still ends the same
+    uint64_t hash;
+    return hdr->size < size && line_index_tail_hash(fs->fd, hdr->size, &hash) && hash == hdr->tail_hash;
+}
+
+// Index the bytes past hdr.size up to the current end of the file
+bool line_index_extend(LineIndex *idx, FileSession *fs) {
+    STATS_SPAN(PHASE_READ);
+    LineIndexHeader *hdr = &idx->hdr;
+    uint64_t size = fs->st.st_size;
+    char *block = malloc(SPLICE_CHUNK);
+    if (!block) return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fs->fd, hdr->size, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    char last = '\n';
+    for (uint64_t offset = hdr->size; offset < size; ) {
+        size_t len = size - offset < SPLICE_CHUNK ? (size_t)(size - offset) : SPLICE_CHUNK;
+        if (!pread_full(fs->fd, block, len, offset)) {
+            free(block);
+            return false;
+        }
+        stats_add(&stats.bytes_read, len);
+        const char *p = block, *end = block + len;
+        while (p < end) {
+            // Newlines left before the next mark is due
+            uint64_t need = hdr->count * LINE_INDEX_STRIDE - hdr->newlines;
+            uint64_t found;
+            p = skip_lines(p, end, need, &found);
+            hdr->newlines += found;
+            if (found == need && !line_index_push(idx, offset + (p - block))) {
+                free(block);
+                return false;
+            }
+        }
+        last = end[-1];
+        offset += len;
+    }
+    free(block);
+    
+    if (size > hdr->size) {
+        hdr->lines = hdr->newlines + (last != '\n');
+        hdr->size = size;
+    }
+    hdr->mtime_ns = stat_mtime_ns(&fs->st);
+    return line_index_tail_hash(fs->fd, size, &hdr->tail_hash);
+}
+
+// Replace the sidecar atomically; failing to store it only costs a rescan
+void line_index_store(const LineIndex *idx, const char *path) {
+    char tmp[MAX_PATH_LENGTH];
+    int n = snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) return;
+    
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return;
+    Buffer parts[2] = {
+        buffer_view((const char *)&idx->hdr, sizeof(idx->hdr)),
+        buffer_view((const char *)idx->marks, idx->hdr.count * sizeof(uint64_t)),
+    };
+    bool written = buffer_writev_fd(parts, 2, fd);
+    if (close(fd) == 0 && written && rename(tmp, path) == 0) return;
+    unlink(tmp);
+}
+
+// Lines first..last (1-based, inclusive; last may run past the end) of the
+// session's file. Only the region between the surrounding marks is read.
+bool read_line_range(FileSession *fs, uint64_t first, uint64_t last, off_t max_size, Buffer *out) {
+    buffer_init(out);
+    LineIndex idx;
+    memset(&idx, 0, sizeof(idx));
+    char path[MAX_PATH_LENGTH];
+    bool persist = fs->st.st_size >= LINE_INDEX_MIN_SIZE && line_index_path(&fs->st, path, sizeof(path));
+    
+    uint64_t indexed = 0;
+    if (!persist || !line_index_load(&idx, fs, path)) {
+        if (!line_index_reset(&idx, &fs->st)) {
+            free(idx.marks);
+            fprintf(stderr, "Memory allocation failed\n");
+            return false;
+        }
+    } else {
+        indexed = idx.hdr.size;
+    }
+    if (indexed != (uint64_t)fs->st.st_size || idx.hdr.mtime_ns != stat_mtime_ns(&fs->st)) {
+        if (!line_index_extend(&idx, fs)) {
+            fprintf(stderr, "Error reading file '%s': %s\n", fs->path, strerror(errno));
+            free(idx.marks);
+            return false;
+        }
+        if (persist) line_index_store(&idx, path);
+    }
+    
+    const LineIndexHeader *hdr = &idx.hdr;
+    if (first > hdr->lines) {
+        fprintf(stderr, "Error: '%s' has only %llu lines\n", fs->path, (unsigned long long)hdr->lines);
+        free(idx.marks);
+        return false;
+    }
+    if (last > hdr->lines) last = hdr->lines;
+    
+    // Read from the mark at or before line first to the one at or after the
+    // start of line last + 1
+    uint64_t mark = (first - 1) / LINE_INDEX_STRIDE;
+    uint64_t stop = (last + LINE_INDEX_STRIDE - 1) / LINE_INDEX_STRIDE;
+    uint64_t begin = idx.marks[mark];
+    uint64_t end = stop < hdr->count ? idx.marks[stop] : hdr->size;
+    free(idx.marks);
+    
+    {
+        STATS_SPAN(PHASE_READ);
+        if (!buffer_reserve(out, end - begin) || !pread_full(fs->fd, out->ptr, end - begin, begin)) {
+            fprintf(stderr, "Error reading file '%s': %s\n", fs->path, strerror(errno));
+            buffer_free(out);
+            return false;
+        }
+        out->len = end - begin;
+        stats_add(&stats.bytes_read, out->len);
+    }
+    
+    uint64_t skip = mark * LINE_INDEX_STRIDE;
+    Buffer range = get_line_range(out, first - skip, last - skip);
+    if (max_size > 0 && (off_t)range.len > max_size) {
+        fprintf(stderr, "Selected lines too large: %s", get_human_readable_size(range.len));
+        fprintf(stderr, " (max: %s)\n", get_human_readable_size(max_size));
+        buffer_free(out);
+        return false;
+    }
+    memmove(out->ptr, range.ptr, range.len);
+    out->len = range.len;
+    return true;
+}
+#endif
+
+// Streaming pipeline
+// Content transforms are stages chained from a source to a sink: grep,
+// line selection (-l, --range), tail, dedupe, squeeze-blank and trim (-n).
+// The source hands the first stage chunks of whole lines; a stage passes the
+// lines it keeps on as views into the same chunk, runs of kept lines in one
+// push, so a stage adds a scan but no copy and no full-size allocation. Only
+// tail, dedupe and trim hold anything across chunks: the last N lines, the
+// previous line and the unfinished last line with any whitespace after it.
+// Working buffers come from the pipeline's pool and are reused for the
+// whole run.
+#define PIPE_CHUNK (16 * BUFFER_SIZE)
+#define PIPE_POOL_SIZE 4
+#define PIPE_MAX_STAGES 8
+
+typedef struct Pipeline Pipeline;
+typedef struct Stage Stage;
+
+struct Stage {
+    // Take len bytes of whole lines (only the input's last chunk may end in
+    // an unterminated line). False once no more input is wanted.
+    bool (*push)(Stage *s, const char *p, size_t len);
+    bool (*finish)(Stage *s);  // End of input: pass on anything held back
+    Stage *next;
+    Pipeline *pipeline;
+};
+
+// What to do with the content; zero fields are stages left out
+typedef struct {
+    const char *grep;     // --grep PATTERN
+    bool regex;           // --regex
+    uint64_t first;       // --range/--line/-l: lines first..last
+    uint64_t last;
+    int tail;             // -t
+    bool trim;            // -n without -b
+    bool dedupe;          // --dedupe
+    bool squeeze_blank;   // --squeeze-blank
+} Transforms;
+
+typedef struct {
+    Stage base;
+    const char *pattern;
+    size_t pattern_len;
+    bool regex;
+#ifndef _WIN32
+    regex_t compiled;
+#endif
+    Buffer line;     // Terminated copy of a line, without REG_STARTEND
+    uint64_t count;  // Matching lines so far
+} GrepStage;
+
+typedef struct {
+    Stage base;
+    uint64_t first, last;
+    uint64_t line;  // Lines seen so far
+} SelectStage;
+
+typedef struct {
+    Stage base;
+    int n;
+    size_t held;  // Newlines in kept, compacted back to n every n lines
+    Buffer kept;
+} TailStage;
+
+typedef struct {
+    Stage base;
+    bool started;    // Past the leading whitespace
+    Buffer pending;  // Unfinished last line and whitespace that is only kept
+                     // if more content follows; always starts a line
+} TrimStage;
+
+typedef struct {
+    Stage base;
+    bool have_previous;
+    Buffer previous;  // Last line of the previous chunk, newline stripped
+} DedupeStage;
+
+typedef struct {
+    Stage base;
+    size_t newlines;  // Newlines ending the output so far (its start counts as one)
+} SqueezeStage;
+
+typedef struct {
+    Stage base;
+    int fd;      // Written to as output accumulates, or -1
+    Buffer *out; // Collected here when fd is -1
+    Buffer pending;
+} SinkStage;
+
+struct Pipeline {
+    Stage *first;
+    Buffer pool[PIPE_POOL_SIZE];
+    int pooled;
+    bool failed;  // A read, write or allocation failed
+    int count;
+    Stage *stages[PIPE_MAX_STAGES];
+    GrepStage grep;
+    SelectStage select;
+    TailStage tail;
+    TrimStage trim;
+    DedupeStage dedupe;
+    SqueezeStage squeeze;
+    SinkStage sink;
+};
+
+// An empty working buffer, reusing a returned one when there is one
+Buffer pipeline_take(Pipeline *pl) {
+    Buffer buf;
+    if (pl->pooled > 0) {
+        buf = pl->pool[--pl->pooled];
+        buf.len = 0;
+    } else {
+        buffer_init(&buf);
+    }
+    return buf;
+}
+
+void pipeline_give(Pipeline *pl, Buffer *buf) {
+    if (pl->pooled < PIPE_POOL_SIZE && buf->owner == BUFFER_HEAP && buf->ptr) {
+        pl->pool[pl->pooled++] = *buf;
+    } else {
+        buffer_free(buf);
+    }
+    buffer_init(buf);
+}
+
+static inline bool stage_pass(Stage *s, const char *p, size_t len) {
+    return len == 0 || s->next->push(s->next, p, len);
+}
+
+static inline bool stage_fail(Stage *s) {
+    s->pipeline->failed = true;
+    return false;
+}
+
+bool stage_finish_next(Stage *s) {
+    return s->next->finish(s->next);
+}
+
+// End of the line starting at p: just past its newline, or end
+static inline const char* line_end(const ScanKernels *kernels, const char *p, const char *end) {
+    const char *nl = kernels->find_newline(p, end - p);
+    return nl ? nl + 1 : end;
+}
+
+static inline size_t line_body(const char *line, const char *next) {
+    return next - line - (next > line && next[-1] == '\n');
+}
+
+bool grep_push(Stage *s, const char *p, size_t len) {
+    GrepStage *g = (GrepStage *)s;
+    const ScanKernels *kernels = scan_kernels();
+    const char *end = p + len;
+    const char *run = p, *run_end = p;  // Matching lines not yet passed on
+
+    while (p < end) {
+        const char *line = p;
+        if (!g->regex) {
+            const char *hit = kernels->find_literal(p, end - p, g->pattern, g->pattern_len);
+            if (!hit) break;
+            const char *nl = kernels->find_last_newline(p, hit - p);
+            if (nl) line = nl + 1;
+            p = hit;
+        }
+        const char *next = line_end(kernels, p, end);
+        p = next;
+
+#ifndef _WIN32
+        if (g->regex) {
+            size_t body = line_body(line, next);
+#ifdef REG_STARTEND
+            regmatch_t span = { .rm_so = 0, .rm_eo = (regoff_t)body };
+            bool matched = regexec(&g->compiled, line, 1, &span, REG_STARTEND) == 0;
+#else
+            // regexec wants a string; buffer_reserve leaves room for the NUL
+            g->line.len = 0;
+            if (!buffer_append(&g->line, line, body)) return stage_fail(s);
+            g->line.ptr[body] = '\0';
+            bool matched = regexec(&g->compiled, g->line.ptr, 0, NULL, 0) == 0;
+#endif
+            if (!matched) continue;
+        }
+#endif
+        g->count++;
+        if (line != run_end) {
+            if (!stage_pass(s, run, run_end - run)) return false;
+            run = line;
+        }
+        run_end = next;
+    }
+    return stage_pass(s, run, run_end - run);
+}
+
+bool select_push(Stage *s, const char *p, size_t len) {
+    SelectStage *sel = (SelectStage *)s;
+    const char *end = p + len;
+    uint64_t found;
+    if (sel->line + 1 < sel->first) {
+        p = skip_lines(p, end, sel->first - 1 - sel->line, &found);
+        sel->line += found;
+        if (sel->line + 1 < sel->first) return true;
+    }
+    const char *stop = skip_lines(p, end, sel->last - sel->line, &found);
+    sel->line += found;
+    if (!stage_pass(s, p, stop - p)) return false;
+    return sel->line < sel->last;
+}
+
+bool tail_push(Stage *s, const char *p, size_t len) {
+    TailStage *t = (TailStage *)s;
+    if (!buffer_append(&t->kept, p, len)) return stage_fail(s);
+    t->held += scan_kernels()->count_newlines(p, len);
+    if (t->held / 2 >= (size_t)t->n) {
+        Buffer last = get_last_n_lines(&t->kept, t->n);
+        memmove(t->kept.ptr, last.ptr, last.len);
+        t->kept.len = last.len;
+        t->held = t->n;
+    }
+    return true;
+}
+
+bool tail_finish(Stage *s) {
+    TailStage *t = (TailStage *)s;
+    Buffer last = get_last_n_lines(&t->kept, t->n);
+    bool ok = stage_pass(s, last.ptr, last.len) || !s->pipeline->failed;
+    pipeline_give(s->pipeline, &t->kept);
+    return ok && stage_finish_next(s);
+}
+
+bool trim_push(Stage *s, const char *p, size_t len) {
+    TrimStage *t = (TrimStage *)s;
+    const ScanKernels *kernels = scan_kernels();
+    if (!t->started) {
+        size_t lead = kernels->leading_space(p, len);
+        p += lead;
+        len -= lead;
+        if (len == 0) return true;
+        t->started = true;
+    }
+    // Lines up to the last newline with content after it are final. They
+    // go on whole: what is pending is completed by p's first line and
+    // passed as one piece, so later stages never see a line split in two.
+    size_t body = len - kernels->trailing_space(p, len);
+    const char *last_nl = body > 0 ? kernels->find_last_newline(p, body) : NULL;
+    if (last_nl) {
+        const char *done = last_nl + 1;
+        if (t->pending.len > 0) {
+            const char *first = line_end(kernels, p, done);
+            if (!buffer_append(&t->pending, p, first - p)) return stage_fail(s);
+            if (!stage_pass(s, t->pending.ptr, t->pending.len)) return false;
+            t->pending.len = 0;
+            len -= first - p;
+            p = first;
+        }
+        if (!stage_pass(s, p, done - p)) return false;
+        len -= done - p;
+        p = done;
+    }
+    if (!buffer_append(&t->pending, p, len)) return stage_fail(s);
+    return true;
+}
+
+bool trim_finish(Stage *s) {
+    TrimStage *t = (TrimStage *)s;
+    size_t keep = t->pending.len - scan_kernels()->trailing_space(t->pending.ptr, t->pending.len);
+    bool ok = stage_pass(s, t->pending.ptr, keep) || !s->pipeline->failed;
+    pipeline_give(s->pipeline, &t->pending);  // Trailing whitespace is dropped
+    return ok && stage_finish_next(s);
+}
+
+bool dedupe_push(Stage *s, const char *p, size_t len) {
+    DedupeStage *d = (DedupeStage *)s;
+    const ScanKernels *kernels = scan_kernels();
+    const char *end = p + len;
+    const char *run = p;
+    const char *previous = d->previous.ptr;
+    size_t previous_len = d->previous.len;
+    bool have_previous = d->have_previous;
+
+    while (p < end) {
+        const char *next = line_end(kernels, p, end);
+        size_t body = line_body(p, next);
+        if (have_previous && body == previous_len && memcmp(p, previous, body) == 0) {
+            if (!stage_pass(s, run, p - run)) return false;
+            run = next;
+        }
+        previous = p;
+        previous_len = body;
+        have_previous = true;
+        p = next;
+    }
+    if (!stage_pass(s, run, end - run)) return false;
+
+    // The chunk is about to be reused: keep a copy of its last line
+    if (len > 0) {
+        d->previous.len = 0;
+        if (!buffer_append(&d->previous, previous, previous_len)) return stage_fail(s);
+        d->have_previous = true;
+    }
+    return true;
+}
+
+bool dedupe_finish(Stage *s) {
+    pipeline_give(s->pipeline, &((DedupeStage *)s)->previous);
+    return stage_finish_next(s);
+}
+
+// A blank line that follows another is the third newline in a row, so the
+// input is searched for "\n\n\n" in bulk instead of line by line
+bool squeeze_push(Stage *s, const char *p, size_t len) {
+    SqueezeStage *q = (SqueezeStage *)s;
+    const ScanKernels *kernels = scan_kernels();
+    const char *end = p + len;
+    
+    // Newlines continuing the run the previous chunk ended with
+    const char *run = p, *scan = p;
+    while (scan < end && *scan == '\n') scan++;
+    size_t keep = q->newlines < 2 ? 2 - q->newlines : 0;
+    if ((size_t)(scan - p) > keep) {
+        if (!stage_pass(s, p, keep)) return false;
+        run = scan;
+    }
+    
+    const char *hit;
+    while ((hit = kernels->find_literal(scan, end - scan, "\n\n\n", 3))) {
+        if (!stage_pass(s, run, hit + 2 - run)) return false;
+        for (scan = hit + 2; scan < end && *scan == '\n'; scan++) {}
+        run = scan;
+    }
+    if (!stage_pass(s, run, end - run)) return false;
+    
+    size_t trailing = 0;
+    while (trailing < len && p[len - 1 - trailing] == '\n') trailing++;
+    q->newlines = trailing < len ? trailing : q->newlines + trailing;
+    return true;
+}
+
+bool sink_flush(SinkStage *k) {
+    if (k->pending.len == 0) return true;
+    bool ok = buffer_write_fd(&k->pending, k->fd);
+    k->pending.len = 0;
+    return ok;
+}
+
+bool sink_push(Stage *s, const char *p, size_t len) {
+    SinkStage *k = (SinkStage *)s;
+    if (k->fd < 0) return buffer_append(k->out, p, len) || stage_fail(s);
+
+    // Small pieces are batched into one write; large ones go out directly
+    if (len >= PIPE_CHUNK) {
+        Buffer view = buffer_view(p, len);
+        if (!sink_flush(k) || !buffer_write_fd(&view, k->fd)) return stage_fail(s);
+        return true;
+    }
+    if (!buffer_append(&k->pending, p, len)) return stage_fail(s);
+    if (k->pending.len >= PIPE_CHUNK && !sink_flush(k)) return stage_fail(s);
+    return true;
+}
+
+bool sink_finish(Stage *s) {
+    SinkStage *k = (SinkStage *)s;
+    bool ok = k->fd < 0 || sink_flush(k);
+    pipeline_give(s->pipeline, &k->pending);
+    return ok || stage_fail(s);
+}
+
+void pipeline_add(Pipeline *pl, Stage *s, bool (*push)(Stage *, const char *, size_t),
+                  bool (*finish)(Stage *)) {
+    s->push = push;
+    s->finish = finish;
+    s->pipeline = pl;
+    s->next = NULL;
+    if (pl->count > 0) pl->stages[pl->count - 1]->next = s;
+    pl->stages[pl->count++] = s;
+    pl->first = pl->stages[0];
+}
+
+// Build the stages for t, ending in a sink that writes to fd, or (fd -1)
+// appends to out. False if the grep pattern does not compile.
+bool pipeline_init(Pipeline *pl, const Transforms *t, int fd, Buffer *out) {
+    memset(pl, 0, sizeof(*pl));
+    if (t->grep) {
+        GrepStage *g = &pl->grep;
+        g->pattern = t->grep;
+        g->pattern_len = strlen(t->grep);
+        g->regex = t->regex;
+        if (t->regex) {
+#ifdef _WIN32
+            fprintf(stderr, "Error: --regex is not supported on Windows\n");
+            return false;
+#else
+            int err = regcomp(&g->compiled, t->grep, REG_EXTENDED | REG_NOSUB);
+            if (err != 0) {
+                char message[256];
+                regerror(err, &g->compiled, message, sizeof(message));
+                fprintf(stderr, "Error: Invalid regular expression '%s': %s\n", t->grep, message);
+                g->regex = false;
+                return false;
+            }
+#endif
+        }
+        g->line = pipeline_take(pl);
+        pipeline_add(pl, &g->base, grep_push, stage_finish_next);
+    }
+    if (t->first > 0) {
+        pl->select.first = t->first;
+        pl->select.last = t->last;
+        pipeline_add(pl, &pl->select.base, select_push, stage_finish_next);
+    }
+    if (t->tail > 0) {
+        pl->tail.n = t->tail;
+        pl->tail.kept = pipeline_take(pl);
+        pipeline_add(pl, &pl->tail.base, tail_push, tail_finish);
+    }
+    if (t->dedupe) {
+        pl->dedupe.previous = pipeline_take(pl);
+        pipeline_add(pl, &pl->dedupe.base, dedupe_push, dedupe_finish);
+    }
+    if (t->squeeze_blank) {
+        pl->squeeze.newlines = 1;
+        pipeline_add(pl, &pl->squeeze.base, squeeze_push, stage_finish_next);
+    }
+    // Last, so the trim applies to what is actually delivered
+    if (t->trim) {
+        pl->trim.pending = pipeline_take(pl);
+        pipeline_add(pl, &pl->trim.base, trim_push, trim_finish);
+    }
+
+    pl->sink.fd = fd;
+    pl->sink.out = out;
+    pl->sink.pending = pipeline_take(pl);
+    pipeline_add(pl, &pl->sink.base, sink_push, sink_finish);
+    return true;
+}
+
+void pipeline_free(Pipeline *pl) {
+#ifndef _WIN32
+    if (pl->grep.regex) regfree(&pl->grep.compiled);
+#endif
+    buffer_free(&pl->grep.line);
+    buffer_free(&pl->tail.kept);
+    buffer_free(&pl->trim.pending);
+    buffer_free(&pl->dedupe.previous);
+    buffer_free(&pl->sink.pending);
+    for (int i = 0; i < pl->pooled; i++) buffer_free(&pl->pool[i]);
+    pl->pooled = 0;
+}
+
+// Whether t changes the content at all
+bool transforms_active(const Transforms *t) {
+    return t->grep || t->first > 0 || t->tail > 0 || t->trim || t->dedupe || t->squeeze_blank;
+}
+
+// Run fd through the pipeline, PIPE_CHUNK at a time (a chunk only grows
+// for a line longer than that). Reading stops as soon as the stages want
+// no more input. False on a read, write or allocation error.
+bool pipeline_run_fd(Pipeline *pl, int fd) {
+    STATS_SPAN(PHASE_TRANSFORM);
+    const ScanKernels *kernels = scan_kernels();
+    Buffer chunk = pipeline_take(pl);
+    size_t size = PIPE_CHUNK;
+    bool more = true;
+
+    while (more) {
+        if (!buffer_reserve(&chunk, size - chunk.len)) {
+            fprintf(stderr, "Memory allocation failed\n");
+            pl->failed = true;
+            break;
+        }
+        ssize_t got = read(fd, chunk.ptr + chunk.len, size - chunk.len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            pl->failed = true;
+            break;
+        }
+        stats_add(&stats.bytes_read, got);
+        if (got == 0) {
+            // The last line may lack its newline; the spare byte covers it
+            if (chunk.len > 0) pl->first->push(pl->first, chunk.ptr, chunk.len);
+            break;
+        }
+        chunk.len += got;
+
+        const char *nl = kernels->find_last_newline(chunk.ptr, chunk.len);
+        if (!nl) {
+            if (chunk.len == size) size *= 2;  // One line fills the chunk
+            continue;
+        }
+        size_t done = nl + 1 - chunk.ptr;
+        more = pl->first->push(pl->first, chunk.ptr, done);
+        memmove(chunk.ptr, chunk.ptr + done, chunk.len - done);
+        chunk.len -= done;
+    }
+    pipeline_give(pl, &chunk);
+    if (!pl->failed) pl->first->finish(pl->first);
+    return !pl->failed;
+}
+
+// Run content already in memory through the pipeline
+bool pipeline_run_buffer(Pipeline *pl, const Buffer *content) {
+    STATS_SPAN(PHASE_TRANSFORM);
+    if (content->len > 0) pl->first->push(pl->first, content->ptr, content->len);
+    if (!pl->failed) pl->first->finish(pl->first);
+    return !pl->failed;
+}
+
+// Send selected file content to stdout or the clipboard; returns exit status
+int deliver_content(const Buffer *content, bool to_stdout, const char *filename) {
+    if (to_stdout) {
+        fflush(stdout);
+        return buffer_write_fd(content, STDOUT_FILENO) ? 0 : 1;
+    }
+    if (copy_to_clipboard(content)) {
+        printf("✓ Copied %ld characters from '%s' to clipboard\n", 
+               (long)content->len, filename);
+        return 0;
+    }
+    print_clipboard_hint();
+    return 1;
+}
+
+// Run fd (or, with fd -1, content) through t and deliver the result as
+// deliver_content does; stdout gets it as it is produced. max_size (0 =
+// unlimited) applies to what the clipboard would get.
+int deliver_transformed(const Transforms *t, int fd, const Buffer *content, off_t max_size,
+                        bool to_stdout, const char *name) {
+    if (fd < 0 && !transforms_active(t)) return deliver_content(content, to_stdout, name);
+    Buffer out;
+    buffer_init(&out);
+    Pipeline pipeline;
+    if (to_stdout) fflush(stdout);
+    if (!pipeline_init(&pipeline, t, to_stdout ? STDOUT_FILENO : -1, &out)) {
+        pipeline_free(&pipeline);
+        return 1;
+    }
+    bool success = fd >= 0 ? pipeline_run_fd(&pipeline, fd) : pipeline_run_buffer(&pipeline, content);
+    uint64_t matches = pipeline.grep.count;
+    pipeline_free(&pipeline);
+    
+    int status = 0;
+    if (!success) {
+        fprintf(stderr, "Error: Failed to process %s: %s\n", name, strerror(errno));
+        status = 1;
+    } else if (t->grep && matches == 0) {
+        fprintf(stderr, "No lines in %s match '%s'\n", name, t->grep);
+        status = 1;
+    } else if (!to_stdout && max_size > 0 && (off_t)out.len > max_size) {
+        fprintf(stderr, "Selected lines too large: %s", get_human_readable_size(out.len));
+        fprintf(stderr, " (max: %s)\n", get_human_readable_size(max_size));
+        status = 1;
+    } else if (!to_stdout) {
+        status = deliver_content(&out, false, name);
+    }
+    buffer_free(&out);
+    return status;
+}
+
+// Multi-file bundles
+// `copy a b dir/` gathers every regular file named, or found under a named
+// directory (sorted, depth first, symlinked directories not followed), into
+// one bundle with a "==> path <==" header per file, like head(1). Files are
+// read on a thread pool: each worker owns a deque of file indices, takes
+// from its front and steals from the back of another's when it runs dry,
+// so a few huge files do not leave the rest of the pool idle. Output order
+// is the list order whatever the completion order; stdout gets each file
+// as soon as it and all before it are ready. Workers stay at most
+// BUNDLE_WINDOW files per thread ahead of the writer, so memory follows
+// the window rather than the size of the tree.
+#define BUNDLE_MAX_THREADS 64
+#define BUNDLE_WINDOW 4
+
+typedef struct {
+    char *path;
+    off_t size;
+    Buffer content;
+    bool ok;
+    bool done;
+} BundleFile;
+
+typedef struct {
+    BundleFile *files;
+    size_t count;
+    size_t capacity;
+    off_t total_size;
+} FileList;
+
+bool file_list_add(FileList *list, const char *path, off_t size) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        BundleFile *grown = realloc(list->files, capacity * sizeof(*grown));
+        if (!grown) return false;
+        list->files = grown;
+        list->capacity = capacity;
+    }
+    BundleFile *f = &list->files[list->count];
+    memset(f, 0, sizeof(*f));
+    f->path = strdup(path);
+    if (!f->path) return false;
+    f->size = size;
+    buffer_init(&f->content);
+    list->count++;
+    list->total_size += size;
+    return true;
+}
+
+void file_list_free(FileList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->files[i].path);
+        buffer_free(&list->files[i].content);
+    }
+    free(list->files);
+    memset(list, 0, sizeof(*list));
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Add path to the list. Named paths must be files or directories; inside a
+// directory, anything that is neither (or a symlink to a directory) is
+// skipped with at most a warning. False only for bad named paths or when
+// out of memory.
+bool file_list_collect(FileList *list, const char *path, bool named) {
+    struct stat st;
+#ifdef _WIN32
+    int found = stat(path, &st);
+#else
+    int found = named ? stat(path, &st) : lstat(path, &st);
+#endif
+    if (found != 0) {
+        fprintf(stderr, "%s: Cannot access '%s': %s\n", named ? "Error" : "Warning", path, strerror(errno));
+        return !named;
+    }
+#ifndef _WIN32
+    if (S_ISLNK(st.st_mode)) {
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return true;
+    }
+#endif
+    if (S_ISREG(st.st_mode)) return file_list_add(list, path, st.st_size);
+    
+#ifndef _WIN32
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            fprintf(stderr, "Warning: Skipping '%s': %s\n", path, strerror(errno));
+            return true;
+        }
+        
+        char **names = NULL;
+        size_t count = 0, capacity = 0;
+        struct dirent *entry;
+        bool ok = true;
+        while (ok && (entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 32;
+                char **grown = realloc(names, capacity * sizeof(*names));
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                names = grown;
+            }
+            names[count] = strdup(entry->d_name);
+            ok = names[count++] != NULL;
+        }
+        closedir(dir);
+        if (ok) qsort(names, count, sizeof(*names), compare_names);
+        
+        size_t base_len = strlen(path);
+        bool has_sep = base_len > 0 && path[base_len - 1] == PATH_SEPARATOR;
+        for (size_t i = 0; ok && i < count; i++) {
+            char child[MAX_PATH_LENGTH];
+            int n = snprintf(child, sizeof(child), "%s%s%s", path, has_sep ? "" : "/", names[i]);
+            if (n < 0 || (size_t)n >= sizeof(child)) {
+                fprintf(stderr, "Warning: Skipping over-long path in '%s'\n", path);
+                continue;
+            }
+            ok = file_list_collect(list, child, false);
+        }
+        for (size_t i = 0; i < count; i++) free(names[i]);
+        free(names);
+        return ok;
+    }
+#endif
+    
+    if (named) fprintf(stderr, "Error: '%s' is not a regular file or directory\n", path);
+    return !named;
+}
+
+// Load one bundle entry; safe to call from any worker. A max_size of 0
+// disables the size limit.
+void bundle_read(BundleFile *f, off_t max_size) {
+    f->ok = read_file(f->path, max_size, &f->content);
+#ifndef _WIN32
+    // Mappings fault lazily; start the I/O here, not in the writer
+    if (f->ok && f->content.owner == BUFFER_MAPPED) {
+        madvise(f->content.ptr, f->content.len, MADV_WILLNEED);
+    }
+#endif
+}
+
+#ifndef _WIN32
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t head, tail;  // Owner takes items[head], thieves take items[tail - 1]
+} WorkDeque;
+
+typedef struct {
+    FileList *list;
+    WorkDeque *deques;
+    int workers;
+    off_t max_size;
+    size_t window;      // How far past consumed a worker may read
+    size_t consumed;    // Files the writer has finished with
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;  // Signals both finished reads and writer progress
+} BundlePool;
+
+typedef struct {
+    BundlePool *pool;
+    int id;
+} BundleWorker;
+
+// Next file for worker id: its own lowest index, else the highest index
+// left in the first other deque that still has work
+bool bundle_take(BundlePool *pool, int id, size_t *index) {
+    for (int k = 0; k < pool->workers; k++) {
+        WorkDeque *q = &pool->deques[(id + k) % pool->workers];
+        pthread_mutex_lock(&q->lock);
+        bool found = q->head < q->tail;
+        if (found) *index = k == 0 ? q->items[q->head++] : q->items[--q->tail];
+        pthread_mutex_unlock(&q->lock);
+        if (found) return true;
+    }
+    return false;
+}
+
+void* bundle_worker(void *arg) {
+    BundleWorker *w = arg;
+    BundlePool *pool = w->pool;
+    size_t index;
+    while (bundle_take(pool, w->id, &index)) {
+        BundleFile *f = &pool->list->files[index];
+        // The writer's next file is always inside the window, so this
+        // never waits on work that only a waiting worker could do
+        pthread_mutex_lock(&pool->done_lock);
+        while (index >= pool->consumed + pool->window) {
+            pthread_cond_wait(&pool->done_cond, &pool->done_lock);
+        }
+        pthread_mutex_unlock(&pool->done_lock);
+        
+        bundle_read(f, pool->max_size);
+        pthread_mutex_lock(&pool->done_lock);
+        f->done = true;
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->done_lock);
+    }
+    return NULL;
+}
+
+// Worker count: online CPUs (or $COPY_THREADS), at most one per file
+int bundle_thread_count(size_t files) {
+    const char *env = getenv("COPY_THREADS");
+    long n = env && *env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > BUNDLE_MAX_THREADS) n = BUNDLE_MAX_THREADS;
+    if ((size_t)n > files) n = (long)files;
+    return (int)n;
+}
+#endif
+
+// Header, content and a closing newline for entry f, appended to out or
+// written to fd when out is NULL
+bool bundle_write_entry(const BundleFile *f, bool first, Buffer *out, int fd) {
+    char header[MAX_PATH_LENGTH + 16];
+    int n = snprintf(header, sizeof(header), "%s==> %s <==\n", first ? "" : "\n", f->path);
+    if (n < 0) return false;
+    if ((size_t)n >= sizeof(header)) n = sizeof(header) - 1;
+    
+    Buffer parts[3];
+    parts[0] = buffer_view(header, n);
+    parts[1] = buffer_slice(&f->content, 0, f->content.len);
+    bool terminated = f->content.len == 0 || f->content.ptr[f->content.len - 1] == '\n';
+    parts[2] = buffer_view("\n", terminated ? 0 : 1);
+    
+    for (int i = 0; i < 3; i++) {
+        bool ok = out ? buffer_append(out, parts[i].ptr, parts[i].len) : buffer_write_fd(&parts[i], fd);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Read every listed file in parallel and deliver the bundle; returns the
+// exit status. max_size (0 = unlimited) applies to each file.
+int copy_bundle(FileList *list, off_t max_size, bool to_stdout) {
+    Buffer bundle;
+    buffer_init(&bundle);
+    bool write_ok = true;
+    size_t failed = 0, emitted = 0;
+    if (to_stdout) fflush(stdout);
+    
+#ifndef _WIN32
+    BundlePool pool;
+    pool.list = list;
+    pool.workers = bundle_thread_count(list->count);
+    pool.max_size = max_size;
+    pool.window = (size_t)pool.workers * BUNDLE_WINDOW;
+    pool.consumed = 0;
+    pool.deques = calloc(pool.workers, sizeof(WorkDeque));
+    BundleWorker *workers = calloc(pool.workers, sizeof(BundleWorker));
+    pthread_t *threads = calloc(pool.workers, sizeof(pthread_t));
+    size_t *items = malloc((list->count + 1) * sizeof(size_t));
+    if (!pool.deques || !workers || !threads || !items) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(pool.deques);
+        free(workers);
+        free(threads);
+        free(items);
+        return 1;
+    }
+    pthread_mutex_init(&pool.done_lock, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+    
+    // Deal files out round-robin so every worker starts near the front
+    size_t next = 0;
+    for (int w = 0; w < pool.workers; w++) {
+        WorkDeque *q = &pool.deques[w];
+        pthread_mutex_init(&q->lock, NULL);
+        q->items = items + next;
+        q->head = q->tail = 0;
+        for (size_t i = w; i < list->count; i += pool.workers) q->items[q->tail++] = i;
+        next += q->tail;
+    }
+    
+    int started = 0;
+    for (; started < pool.workers; started++) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        if (pthread_create(&threads[started], NULL, bundle_worker, &workers[started]) != 0) break;
+    }
+    if (started == 0) {
+        // No threads available: do the work here, with nothing to wait for
+        pool.window = list->count;
+        workers[0].pool = &pool;
+        workers[0].id = 0;
+        bundle_worker(&workers[0]);
+    }
+#endif
+    
+    for (size_t i = 0; i < list->count; i++) {
+        BundleFile *f = &list->files[i];
+#ifndef _WIN32
+        pthread_mutex_lock(&pool.done_lock);
+        while (!f->done) pthread_cond_wait(&pool.done_cond, &pool.done_lock);
+        pthread_mutex_unlock(&pool.done_lock);
+#else
+        bundle_read(f, max_size);
+#endif
+        if (!f->ok) {
+            failed++;
+        } else {
+            // Small files are batched into one write; large ones go out directly
+            if (write_ok && to_stdout && (f->content.len >= BUFFER_SIZE || bundle.len >= SPLICE_CHUNK)) {
+                write_ok = buffer_write_fd(&bundle, STDOUT_FILENO);
+                bundle.len = 0;
+            }
+            if (write_ok) {
+                bool direct = to_stdout && f->content.len >= BUFFER_SIZE;
+                write_ok = bundle_write_entry(f, emitted == 0, direct ? NULL : &bundle, STDOUT_FILENO);
+            }
+            emitted++;
+            buffer_free(&f->content);
+        }
+#ifndef _WIN32
+        pthread_mutex_lock(&pool.done_lock);
+        pool.consumed = i + 1;
+        pthread_cond_broadcast(&pool.done_cond);
+        pthread_mutex_unlock(&pool.done_lock);
+#endif
+    }
+    if (write_ok && to_stdout) write_ok = buffer_write_fd(&bundle, STDOUT_FILENO);
+    
+#ifndef _WIN32
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    for (int w = 0; w < pool.workers; w++) pthread_mutex_destroy(&pool.deques[w].lock);
+    pthread_mutex_destroy(&pool.done_lock);
+    pthread_cond_destroy(&pool.done_cond);
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    free(items);
+#endif
+    
+    int status = failed > 0 || !write_ok ? 1 : 0;
+    if (!write_ok) fprintf(stderr, "Error: Failed to write bundle: %s\n", strerror(errno));
+    if (!to_stdout && write_ok) {
+        if (copy_to_clipboard(&bundle)) {
+            printf("✓ Copied %ld characters from %ld files to clipboard\n", (long)bundle.len, (long)emitted);
+        } else {
+            print_clipboard_hint();
+            status = 1;
+        }
+    }
+    buffer_free(&bundle);
+    return status;
+}
+
+// Multi-file paste
+// `copy -p a b c` (or --from-list FILE) fetches the clipboard once and
+// writes it to every destination. All overwrite prompts come first, so the
+// writes never wait on the user; they then run on a pool of writer threads,
+// each destination staged and published as a single paste would be, and a
+// line per destination reports how it went.
+#define PASTE_MIN_THREADS 8
+
+typedef struct {
+    const char *path;
+    bool skipped;   // Declined at the prompt
+    bool ok;
+    int error;      // errno of a failed write
+} PasteTarget;
+
+typedef struct {
+    PasteTarget *targets;
+    size_t count;
+    const Buffer *content;
+    bool append;
+    size_t next;    // Next target to claim, shared by the workers
+} PasteBatch;
+
+// Read a --from-list file ("-" for stdin) and add one destination per
+// non-empty line to paths. The lines point into list, which must outlive
+// paths.
+bool paste_read_list(const char *source, Buffer *list, const char ***paths, int *count) {
+    buffer_init(list);
+    bool ok;
+    if (strcmp(source, "-") == 0) {
+        ok = buffer_read_fd(list, fileno(stdin));
+    } else {
+        Buffer file;
+        ok = read_file(source, 0, &file);
+        if (!ok) return false;
+        ok = buffer_append(list, file.ptr, file.len);  // Copied: the lines are split in place
+        buffer_free(&file);
+    }
+    if (!ok || !buffer_reserve(list, 1)) {
+        fprintf(stderr, "Error: Failed to read list '%s'\n", source);
+        return false;
+    }
+    list->ptr[list->len] = '\n';  // Terminate the last line in the spare byte
+    
+    size_t lines = 0;
+    for (const char *p = list->ptr, *end = list->ptr + list->len; p < end; p++) {
+        p = memchr(p, '\n', end - p + 1);
+        lines++;
+    }
+    const char **grown = realloc(*paths, (*count + lines + 1) * sizeof(*grown));
+    if (!grown) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    *paths = grown;
+    
+    char *line = list->ptr;
+    char *end = list->ptr + list->len;
+    while (line < end) {
+        char *nl = memchr(line, '\n', end - line + 1);
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+        if (*line) grown[(*count)++] = line;
+        line = nl + 1;
+    }
+    return true;
+}
+
+// Ask about every destination that would lose content; returns how many
+// are left to write
+size_t paste_confirm(PasteTarget *targets, size_t count, bool append, bool force) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        off_t size = append || force ? -1 : get_file_size(targets[i].path);
+        if (size == 0) {
+            printf("Note: File '%s' exists but is empty. Proceeding.\n", targets[i].path);
+        } else if (size > 0) {
+            printf("Warning: File '%s' already exists (%s).\n",
+                   targets[i].path, get_human_readable_size(size));
+            if (!get_user_confirmation("Do you want to overwrite it?", true)) {
+                targets[i].skipped = true;
+                continue;
+            }
+        }
+        kept++;
+    }
+    return kept;
+}
+
+// Write content to one destination; safe to call from any worker
+void paste_write_one(PasteTarget *t, const Buffer *content, bool append) {
+    OutputFile out;
+    if (!output_open(&out, t->path, append, append ? 0 : content->len)) {
+        t->error = errno;
+        return;
+    }
+    
+    struct stat st;
+    bool separate = append && fstat(out.fd, &st) == 0 && st.st_size > 0;
+    Buffer parts[2] = { buffer_view("\n", separate ? 1 : 0), *content };
+    t->ok = buffer_writev_fd(parts, 2, out.fd);
+    if (!t->ok) {
+        t->error = errno;
+        output_abort(&out);
+        return;
+    }
+    t->ok = output_commit(&out);
+    if (!t->ok) t->error = errno;
+}
+
+#ifndef _WIN32
+void* paste_worker(void *arg) {
+    PasteBatch *batch = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count) break;
+        PasteTarget *t = &batch->targets[i];
+        if (!t->skipped) paste_write_one(t, batch->content, batch->append);
+    }
+    return NULL;
+}
+
+// Writers mostly wait on the disk, so unless $COPY_THREADS says otherwise
+// there may be more of them than CPUs
+int paste_thread_count(size_t files) {
+    const char *env = getenv("COPY_THREADS");
+    int n = bundle_thread_count(files);
+    if (!(env && *env) && n < PASTE_MIN_THREADS) n = files < PASTE_MIN_THREADS ? (int)files : PASTE_MIN_THREADS;
+    return n;
+}
+#endif
+
+// Write content to every destination not skipped and report each; returns
+// the exit status
+int paste_to_targets(PasteTarget *targets, size_t count, const Buffer *content, bool append) {
+    PasteBatch batch = { targets, count, content, append, 0 };
+#ifndef _WIN32
+    output_umask();  // Cache it before the workers need it
+    int workers = paste_thread_count(count);
+    pthread_t threads[BUNDLE_MAX_THREADS];
+    int started = 0;
+    while (started < workers - 1 &&
+           pthread_create(&threads[started], NULL, paste_worker, &batch) == 0) {
+        started++;
     }
-    
-    FILE *file = fopen(path, "wb");
-    if (!file) {
-        fprintf(stderr, "Error opening file: %s\n", strerror(errno));
-        return false;
+    paste_worker(&batch);  // Take a share here too, or all of it without threads
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+#else
+    for (size_t i = 0; i < count; i++) {
+        if (!targets[i].skipped) paste_write_one(&targets[i], content, append);
     }
-    fclose(file);
+#endif
     
-    printf("All content successfully deleted from '%s'\n", path);
-    printf("Bytes freed: %s\n", get_human_readable_size(size));
-    return true;
+    size_t written = 0, failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        PasteTarget *t = &targets[i];
+        if (t->skipped) {
+            printf("- Skipped '%s'\n", t->path);
+        } else if (t->ok) {
+            printf("✓ %s %ld bytes to '%s'\n", append ? "Appended" : "Pasted", (long)content->len, t->path);
+            written++;
+        } else {
+            fprintf(stderr, "✗ Failed to write '%s': %s\n", t->path, strerror(t->error));
+            failed++;
+        }
+    }
+    printf("%s %ld bytes to %ld of %ld files\n", append ? "Appended" : "Pasted",
+           (long)content->len, (long)written, (long)count);
+    return failed > 0 ? 1 : 0;
 }
 
-// Pipe/STDIN handling
-char* read_from_stdin() {
-    char *buffer = NULL;
-    size_t size = 0;
-    size_t capacity = 0;
-    char chunk[BUFFER_SIZE];
-    
-    while (!feof(stdin)) {
-        size_t bytes = fread(chunk, 1, BUFFER_SIZE, stdin);
-        if (bytes > 0) {
-            if (size + bytes + 1 > capacity) {
-                capacity = (size + bytes + 1) * 2;
-                buffer = realloc(buffer, capacity);
-                if (!buffer) {
-                    fprintf(stderr, "Memory allocation failed\n");
-                    return NULL;
-                }
-            }
-            memcpy(buffer + size, chunk, bytes);
-            size += bytes;
-        }
+// Confirm, then paste content to every path; returns the exit status
+int paste_to_paths(const char **paths, int count, const Buffer *content, bool append, bool force) {
+    PasteTarget *targets = calloc(count, sizeof(*targets));
+    if (!targets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
     }
+    for (int i = 0; i < count; i++) targets[i].path = paths[i];
     
-    if (buffer) {
-        buffer[size] = '\0';
+    int status;
+    if (paste_confirm(targets, count, append, force) == 0) {
+        printf("Operation cancelled.\n");
+        status = 2;  // User cancelled
+    } else {
+        status = paste_to_targets(targets, count, content, append);
     }
-    
-    return buffer;
+    free(targets);
+    return status;
 }
 
-// String utilities
-char* trim_whitespace(char *str) {
-    if (!str) return NULL;
-    
-    // Trim leading space
-    while (isspace((unsigned char)*str)) str++;
-    
-    if (*str == 0) return str;
-    
-    // Trim trailing space
-    char *end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    
-    *(end + 1) = 0;
-    return str;
+// Tee mode
+// `producer | copy --tee | consumer` passes stdin through to stdout unchanged
+// while capturing it to the clipboard or a file. Between two pipes tee(2)
+// duplicates each chunk into stdout and splice(2) then moves the same bytes
+// on to the capture, so the data never enters userspace; other stdin/stdout
+// pairs go through one fixed buffer. The clipboard reads its copy from a
+// pipe on its own thread, so a slow streaming backend (xclip, xsel, file)
+// throttles the stream rather than growing a buffer. The Wayland and X11
+// selection owners hold the whole clip, so with those the capture grows to
+// the memory budget and then spills to disk like any other stdin capture.
+#ifndef _WIN32
+typedef struct {
+    int fd;
+    bool ok;
+    size_t copied;
+} TeeCapture;
+
+void *tee_capture_thread(void *arg) {
+    TeeCapture *capture = arg;
+    capture->ok = copy_stream_to_clipboard(capture->fd, &capture->copied);
+    close(capture->fd);
+    return NULL;
 }
 
-// Help text
-void print_help() {
-    printf("Copy v%s - File/Clipboard/Pipe Utility\n", VERSION);
-    printf("===========================================\n\n");
-    printf("Usage: copy [OPTIONS] [FILE]\n\n");
-    printf("Operations:\n");
-    printf("  -c, --copy           Copy file/content to clipboard (default)\n");
-    printf("  -p, --paste          Paste clipboard to file (or stdout if no file)\n");
-    printf("  -d, --delete         Delete file content\n");
-    printf("  -a, --append         Append to file instead of overwriting\n");
-    printf("  -s, --stdin          Read from stdin (pipe)\n");
-    printf("  -o, --stdout         Output to stdout\n");
-    printf("  -v, --version        Show version\n\n");
-    
-    printf("Options:\n");
-    printf("  -f, --force          Force operation without confirmation\n");
-    printf("  -n, --no-newline     Don't add newline when reading from stdin\n");
-    printf("  -b, --binary         Treat content as binary (preserve newlines)\n");
-    printf("  -l, --lines N        Copy only first N lines\n");
-    printf("  -t, --tail N         Copy only last N lines\n");
-    printf("  -m, --max-size N     Maximum size in bytes (default: 100MB)\n\n");
-    
-    printf("Exit Codes:\n");
-    printf("  0 - Success\n");
-    printf("  1 - Error\n");
-    printf("  2 - User cancelled\n");
+// Drop len bytes from the front of a pipe
+bool tee_discard(int fd, size_t len) {
+    char chunk[BUFFER_SIZE];
+    while (len > 0) {
+        ssize_t n = read(fd, chunk, len < sizeof(chunk) ? len : sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        len -= n;
+    }
+    return true;
 }
 
-// New features
-char* get_first_n_lines(const char *content, int n) {
-    if (n <= 0 || !content) return NULL;
-    
-    char *result = malloc(strlen(content) + 1);
-    if (!result) return NULL;
-    
-    char *dest = result;
-    const char *src = content;
-    int lines = 0;
+// Copy in_fd to both out_fd and capture_fd. A consumer that goes away stops
+// the pass-through but not the capture, and a failed capture stops only
+// itself; *capture_ok tells whether the capture got everything.
+// Returns the number of bytes read, or -1 on error.
+ssize_t tee_stream(int in_fd, int out_fd, int capture_fd, bool *capture_ok) {
+    STATS_SPAN(PHASE_STREAM);
+    size_t total = 0;
+    bool out_open = true;
+    bool capture_open = true;
     
-    while (*src && lines < n) {
-        *dest = *src;
-        if (*src == '\n') lines++;
-        dest++;
-        src++;
+#ifdef __linux__
+    struct stat in_st, out_st;
+    bool pipes = fstat(in_fd, &in_st) == 0 && S_ISFIFO(in_st.st_mode) &&
+                 fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+    while (pipes && out_open) {
+        ssize_t n = tee(in_fd, out_fd, SPLICE_CHUNK, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) {
+                out_open = false;
+                break;
+            }
+            if (errno == EINVAL && total == 0) break;  // Not teeable: use the buffer
+            return -1;
+        }
+        if (n == 0) {
+            *capture_ok = capture_open;
+            return total;
+        }
+        
+        // The duplicated bytes are still at the front of stdin; move them on
+        for (ssize_t left = n; left > 0; ) {
+            ssize_t moved = capture_open ? splice(in_fd, NULL, capture_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE) : -1;
+            if (moved < 0 && capture_open && errno == EINTR) continue;
+            if (moved <= 0) {
+                capture_open = false;
+                if (!tee_discard(in_fd, left)) return -1;
+                break;
+            }
+            left -= moved;
+        }
+        total += n;
     }
-    *dest = '\0';
     
-    // Trim if we stopped in the middle of a line
-    if (lines == n && *(dest-1) != '\n') {
-        // Find the last newline
-        char *last_newline = strrchr(result, '\n');
-        if (last_newline) {
-            *(last_newline + 1) = '\0';
-        }
+    // Consumer gone: whatever is left only feeds the capture
+    if (!out_open) {
+        ssize_t n = capture_open ? stream_fd(in_fd, NULL, capture_fd) : 0;
+        *capture_ok = capture_open && n >= 0;
+        return n < 0 ? (ssize_t)total : (ssize_t)(total + n);
     }
+#endif
     
-    return result;
+    char chunk[BUFFER_SIZE];
+    for (;;) {
+        ssize_t n = read(in_fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        
+        Buffer piece = buffer_view(chunk, n);
+        if (out_open) out_open = buffer_write_fd(&piece, out_fd);
+        if (capture_open) capture_open = buffer_write_fd(&piece, capture_fd);
+        total += n;
+        if (!out_open && !capture_open) break;
+    }
+    *capture_ok = capture_open;
+    return total;
 }
 
-char* get_last_n_lines(const char *content, int n) {
-    if (n <= 0 || !content) return NULL;
-    
-    const char *end = content + strlen(content);
-    const char *start = end;
-    int lines = 0;
+// Run --tee: capture to filename when given, otherwise to the clipboard.
+// Progress goes to stderr because stdout carries the stream. stdin carries
+// the data, so an existing file is refused rather than confirmed.
+int tee_stdin(const char *filename, bool append, bool force) {
+    signal(SIGPIPE, SIG_IGN);  // A closed consumer must not lose the capture
+    fflush(stdout);
+    bool capture_ok = false;
     
-    // Go backwards to find start of last n lines
-    while (start > content) {
-        start--;
-        if (*start == '\n') {
-            lines++;
-            if (lines == n) {
-                start++; // Move past newline
-                break;
-            }
+    if (filename) {
+        off_t size = append || force ? -1 : get_file_size(filename);  // -1 when it does not exist yet
+        if (size > 0) {
+            fprintf(stderr, "Error: File '%s' already exists (%s); use -f to overwrite or -a to append\n",
+                    filename, get_human_readable_size(size));
+            return 1;
+        }
+        
+        OutputFile out;
+        if (!output_open(&out, filename, append, 0)) return 1;
+        ssize_t n = tee_stream(STDIN_FILENO, STDOUT_FILENO, out.fd, &capture_ok);
+        if (n < 0 || !capture_ok) {
+            fprintf(stderr, "Error: Failed to tee stdin to '%s': %s\n", filename, strerror(errno));
+            output_abort(&out);
+            return 1;
         }
+        if (!output_commit(&out)) return 1;
+        fprintf(stderr, "✓ %s %ld bytes from stdin to '%s'\n",
+                append ? "Appended" : "Wrote", (long)n, filename);
+        return 0;
     }
     
-    // If we didn't find enough newlines, start from beginning
-    if (lines < n) {
-        start = content;
+    int fds[2];
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "Error: Cannot create pipe: %s\n", strerror(errno));
+        return 1;
     }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, SPLICE_CHUNK);  // Best effort; the default also works
+#endif
     
-    char *result = malloc(end - start + 1);
-    if (!result) return NULL;
+    TeeCapture capture = { fds[0], false, 0 };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, tee_capture_thread, &capture) != 0) {
+        fprintf(stderr, "Error: Cannot start clipboard writer\n");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+    ssize_t n = tee_stream(STDIN_FILENO, STDOUT_FILENO, fds[1], &capture_ok);
+    int saved_errno = errno;
+    close(fds[1]);
+    pthread_join(thread, NULL);
     
-    strcpy(result, start);
-    return result;
+    if (n < 0) {
+        fprintf(stderr, "Error: Failed to read stdin: %s\n", strerror(saved_errno));
+        return 1;
+    }
+    if (!capture_ok || !capture.ok) {
+        print_clipboard_hint();
+        return 1;
+    }
+    fprintf(stderr, "✓ Copied %ld characters from stdin to clipboard\n", (long)capture.copied);
+    return 0;
 }
+#endif
 
 // Main function with improved error handling
 int main(int argc, char *argv[]) {
@@ -540,9 +5557,48 @@ int main(int argc, char *argv[]) {
     bool force_mode = false;
     bool no_newline = false;
     bool binary_mode = false;
+    bool count_lines = false;
+    bool regex_mode = false;
+    bool dedupe_mode = false;
+    bool squeeze_mode = false;
+    const char *grep_pattern = NULL;
+    const char *from_list = NULL;
+    bool daemon_mode = false;
+    bool tee_mode = false;
+    int history_index = 0;
     int lines_limit = 0;
     int tail_lines = 0;
+    uint64_t range_first = 0;  // Set by --range/--line; 0 means no range
+    uint64_t range_last = 0;
+    off_t max_size = DEFAULT_MAX_SIZE;
     const char *filename = NULL;
+    const char **paths = malloc(argc * sizeof(*paths));  // Every non-flag argument
+    int path_count = 0;
+    
+    const char *durability = getenv("COPY_FSYNC");
+    if (durability && *durability && !parse_durability(durability, &output_durability)) {
+        fprintf(stderr, "Warning: Ignoring COPY_FSYNC='%s' (expected none, data or full)\n", durability);
+    }
+    
+    const char *trace = getenv("COPY_TRACE");
+    if (trace && *trace && strcmp(trace, "0") != 0) stats_enable();
+    
+    const char *budget = getenv("COPY_MEMORY_BUDGET");
+    if (budget && *budget) {
+        off_t size = parse_size(budget);
+        if (size < 0) {
+            fprintf(stderr, "Warning: Ignoring COPY_MEMORY_BUDGET='%s'\n", budget);
+        } else {
+            memory_budget = (size_t)size;
+        }
+    }
+    
+#ifndef _WIN32
+    const char *backend = getenv("COPY_BACKEND");
+    if (backend && *backend && !parse_backend(backend, &selected_backend)) {
+        fprintf(stderr, "Warning: Ignoring unknown COPY_BACKEND='%s'\n", backend);
+    }
+#endif
     
     // Check if running in interactive mode
     bool is_interactive = isatty(fileno(stdin));
@@ -588,45 +5644,269 @@ int main(int argc, char *argv[]) {
                 if (i + 1 < argc) {
                     tail_lines = atoi(argv[++i]);
                 }
-            } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--max-size") == 0) {
+            } else if (strcmp(argv[i], "--range") == 0) {
+                if (i + 1 < argc && !parse_line_range(argv[++i], &range_first, &range_last)) {
+                    fprintf(stderr, "Error: --range expects A:B with 1 <= A <= B\n");
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--line") == 0) {
+                if (i + 1 < argc) {
+                    char *end;
+                    range_first = range_last = strtoull(argv[++i], &end, 10);
+                    if (!isdigit((unsigned char)*argv[i]) || *end != '\0' || range_first == 0) {
+                        fprintf(stderr, "Error: --line expects N >= 1\n");
+                        return 1;
+                    }
+                }
+            } else if (strcmp(argv[i], "--grep") == 0) {
+                if (i + 1 < argc) grep_pattern = argv[++i];
+            } else if (strcmp(argv[i], "--from-list") == 0) {
+                if (i + 1 < argc) from_list = argv[++i];
+            } else if (strcmp(argv[i], "--regex") == 0) {
+                regex_mode = true;
+            } else if (strcmp(argv[i], "--dedupe") == 0) {
+                dedupe_mode = true;
+            } else if (strcmp(argv[i], "--squeeze-blank") == 0) {
+                squeeze_mode = true;
+            } else if (strcmp(argv[i], "--count-lines") == 0) {
+                count_lines = true;
+            } else if (strcmp(argv[i], "--daemon") == 0) {
+                daemon_mode = true;
+            } else if (strcmp(argv[i], "--tee") == 0) {
+                tee_mode = true;
+            } else if (strcmp(argv[i], "--backend") == 0) {
                 if (i + 1 < argc) {
-                    // Could implement dynamic max size here
                     i++;
+#ifdef _WIN32
+                    fprintf(stderr, "Error: --backend is not supported on Windows\n");
+                    return 1;
+#else
+                    if (!parse_backend(argv[i], &selected_backend)) {
+                        fprintf(stderr, "Error: Unknown backend '%s' (expected auto, wayland, x11, "
+                                "xclip, xsel, file or shm)\n", argv[i]);
+                        return 1;
+                    }
+#endif
+                }
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                stats_enable();
+            } else if (strcmp(argv[i], "--memory-budget") == 0) {
+                if (i + 1 < argc) {
+                    off_t size = parse_size(argv[++i]);
+                    if (size < 0) {
+                        fprintf(stderr, "Error: Invalid size '%s' for --memory-budget\n", argv[i]);
+                        return 1;
+                    }
+                    memory_budget = (size_t)size;
+                }
+            } else if (strcmp(argv[i], "--fsync") == 0) {
+                if (i + 1 < argc && !parse_durability(argv[++i], &output_durability)) {
+                    fprintf(stderr, "Error: --fsync expects none, data or full\n");
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--history") == 0) {
+                if (i + 1 < argc) {
+                    history_index = atoi(argv[++i]);
+                    if (history_index <= 0) {
+                        fprintf(stderr, "Error: --history expects N >= 1 (1 = most recent)\n");
+                        return 1;
+                    }
+                }
+            } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--max-size") == 0) {
+                if (i + 1 < argc) {
+                    max_size = parse_size(argv[++i]);
+                    if (max_size < 0) {
+                        fprintf(stderr, "Error: Invalid size '%s' for %s\n", argv[i], argv[i - 1]);
+                        return 1;
+                    }
                 }
             }
-        } else if (!filename) {
-            filename = argv[i];
+        } else {
+            if (!filename) filename = argv[i];
+            if (paths) paths[path_count++] = argv[i];
+        }
+    }
+    
+    if (range_first > 0 && (lines_limit > 0 || tail_lines > 0)) {
+        fprintf(stderr, "Error: --range and --line cannot be combined with -l or -t\n");
+        return 1;
+    }
+    
+    // --from-list adds paste destinations to those on the command line
+    Buffer list;
+    buffer_init(&list);
+    if (from_list) {
+        if (!paste_mode) {
+            fprintf(stderr, "Error: --from-list names paste destinations and needs -p\n");
+            return 1;
+        }
+        if (strcmp(from_list, "-") == 0 && stdin_mode) {
+            fprintf(stderr, "Error: --from-list - and -s cannot both read stdin\n");
+            return 1;
+        }
+        if (!paste_read_list(from_list, &list, &paths, &path_count)) return 1;
+        if (path_count == 0) {
+            fprintf(stderr, "Error: No destinations in '%s'\n", from_list);
+            return 1;
+        }
+        if (!filename) filename = paths[0];
+    }
+    bool multi_paste = paste_mode && !stdout_mode && (from_list || path_count > 1);
+    
+    // Everything that reshapes content, in pipeline order. -l wins over -t.
+    // Files select lines with seeks instead, so they only take the rest.
+    Transforms transforms;
+    memset(&transforms, 0, sizeof(transforms));
+    transforms.grep = grep_pattern;
+    transforms.regex = regex_mode;
+    transforms.first = range_first;
+    transforms.last = range_last;
+    if (lines_limit > 0) {
+        transforms.first = 1;
+        transforms.last = lines_limit;
+    } else {
+        transforms.tail = tail_lines;
+    }
+    transforms.trim = no_newline && !binary_mode;
+    transforms.dedupe = dedupe_mode;
+    transforms.squeeze_blank = squeeze_mode;
+    Transforms file_transforms;
+    memset(&file_transforms, 0, sizeof(file_transforms));
+    file_transforms.dedupe = dedupe_mode;
+    file_transforms.squeeze_blank = squeeze_mode;
+    
+    if (daemon_mode) {
+#ifdef _WIN32
+        fprintf(stderr, "Error: --daemon is not supported on Windows\n");
+        return 1;
+#else
+        return run_daemon();
+#endif
+    }
+    
+    // Tee passes stdin through verbatim, so it takes no transformations
+    if (tee_mode) {
+        if (transforms_active(&transforms) || lines_limit > 0 || tail_lines > 0 || no_newline ||
+            paste_mode || delete_mode) {
+            fprintf(stderr, "Error: --tee passes stdin through unchanged and cannot be combined with "
+                    "line selection, filters, -n, -p or -d\n");
+            return 1;
+        }
+#ifdef _WIN32
+        fprintf(stderr, "Error: --tee is not supported on Windows\n");
+        return 1;
+#else
+        return tee_stdin(filename, append_mode, force_mode);
+#endif
+    }
+    
+    // Line counting reads the input without touching the clipboard
+    if (count_lines) {
+        int fd = fileno(stdin);
+        if (filename && !stdin_mode) {
+            fd = open(filename, O_RDONLY | O_BINARY);
+            if (fd < 0) {
+                fprintf(stderr, "Error: Cannot open '%s': %s\n", filename, strerror(errno));
+                return 1;
+            }
+        }
+        uint64_t count;
+        bool ok = count_lines_fd(fd, &count);
+        if (fd != fileno(stdin)) close(fd);
+        if (!ok) {
+            fprintf(stderr, "Error: Failed to read input\n");
+            return 1;
+        }
+        printf("%llu\n", (unsigned long long)count);
+        return 0;
+    }
+    
+    // --grep filters stdin or one file on the way to the clipboard or stdout
+    if (grep_pattern) {
+        if (paste_mode || delete_mode || path_count > 1) {
+            fprintf(stderr, "Error: --grep takes one FILE or stdin and cannot be combined with -p or -d\n");
+            return 1;
+        }
+        if (strchr(grep_pattern, '\n')) {
+            fprintf(stderr, "Error: --grep patterns cannot contain newlines\n");
+            return 1;
+        }
+        
+        FileSession session;
+        session.fd = -1;
+        const char *source = "stdin";
+        if (filename && !stdin_mode) {
+            if (!file_session_open(&session, filename, O_RDONLY)) return 1;
+            if (S_ISDIR(session.st.st_mode)) {
+                fprintf(stderr, "Error: '%s' is a directory\n", filename);
+                file_session_close(&session);
+                return 1;
+            }
+            file_session_advise_sequential(&session);
+            source = filename;
         }
+        int status = deliver_transformed(&transforms, session.fd >= 0 ? session.fd : fileno(stdin), NULL,
+                                         force_mode ? 0 : max_size, stdout_mode, source);
+        file_session_close(&session);
+        return status;
     }
     
     // Handle pipe/STDIN input
     if (stdin_mode || (!is_interactive && argc == 1)) {
-        char *input = read_from_stdin();
-        if (!input) {
-            fprintf(stderr, "Failed to read from stdin\n");
+        // Plain stdin-to-clipboard copies need no transformation, so they are
+        // streamed to the backend instead of being buffered first
+        if (!transforms_active(&transforms) && !(filename && paste_mode) && (!stdout_mode || !IS_WINDOWS)) {
+#ifndef _WIN32
+            // Likewise with -o: the kernel moves stdin to stdout directly
+            if (stdout_mode) {
+                fflush(stdout);
+                return stream_fd(fileno(stdin), NULL, STDOUT_FILENO) < 0 ? 1 : 0;
+            }
+#endif
+            size_t copied = 0;
+            if (copy_stream_to_clipboard(fileno(stdin), &copied)) {
+                printf("✓ Copied %ld characters from stdin to clipboard\n", (long)copied);
+                return 0;
+            }
+            fprintf(stderr, "✗ Failed to copy to clipboard\n");
             return 1;
         }
         
-        if (no_newline) {
-            char *trimmed = trim_whitespace(input);
-            // Remove trailing newlines
-            size_t len = strlen(trimmed);
-            while (len > 0 && (trimmed[len-1] == '\n' || trimmed[len-1] == '\r')) {
-                trimmed[--len] = '\0';
-            }
+        // Transforms stream stdin through the pipeline; with -o nothing is
+        // held back, and -l or --range stop reading once their lines are in
+        if (transforms_active(&transforms) && stdout_mode) {
+            return deliver_transformed(&transforms, fileno(stdin), NULL, 0, true, "stdin");
+        }
+        Buffer input;
+        bool read_ok;
+        if (transforms_active(&transforms)) {
+            buffer_init(&input);
+            Pipeline pipeline;
+            pipeline_init(&pipeline, &transforms, -1, &input);
+            read_ok = pipeline_run_fd(&pipeline, fileno(stdin));
+            pipeline_free(&pipeline);
+        } else {
+            read_ok = read_from_stdin(&input);
         }
+        if (!read_ok) {
+            fprintf(stderr, "Failed to read from stdin\n");
+            buffer_free(&input);
+            return 1;
+        }
+        
+        // Binary content is passed through byte for byte
+        Buffer content = input;
         
+        int status = 0;
         if (stdout_mode) {
-            printf("%s", input);
-            free(input);
-            return 0;
+            buffer_write(&content, stdout);
+        } else if (multi_paste) {
+            status = paste_to_paths(paths, path_count, &content, append_mode, force_mode);
         } else if (filename && paste_mode) {
             // Check if file exists and needs confirmation
-            bool file_exists_already = file_exists(filename);
-            bool proceed = true;
+            off_t size = get_file_size(filename);  // -1 when it does not exist yet
             
-            if (file_exists_already && !append_mode && !force_mode) {
-                off_t size = get_file_size(filename);
+            if (size >= 0 && !append_mode && !force_mode) {
                 if (size == 0) {
                     printf("Note: File '%s' exists but is empty. Proceeding.\n", filename);
                 } else {
@@ -634,7 +5914,7 @@ int main(int argc, char *argv[]) {
                            filename, get_human_readable_size(size));
                     if (!get_user_confirmation("Do you want to overwrite it?", true)) {
                         printf("Operation cancelled.\n");
-                        free(input);
+                        buffer_free(&input);
                         return 2;  // User cancelled
                     }
                 }
@@ -642,37 +5922,30 @@ int main(int argc, char *argv[]) {
             
             // Write stdin to file
             if (append_mode) {
-                if (append_to_file(filename, input)) {
-                    printf("Appended %ld bytes to '%s'\n", (long)strlen(input), filename);
-                    free(input);
-                    return 0;
+                if (append_to_file(filename, &content)) {
+                    printf("Appended %ld bytes to '%s'\n", (long)content.len, filename);
                 } else {
-                    free(input);
-                    return 1;
+                    status = 1;
                 }
             } else {
-                if (write_to_file(filename, input, false, force_mode)) {
-                    printf("Written %ld bytes to '%s'\n", (long)strlen(input), filename);
-                    free(input);
-                    return 0;
+                if (write_to_file(filename, &content, false, force_mode)) {
+                    printf("Written %ld bytes to '%s'\n", (long)content.len, filename);
                 } else {
-                    free(input);
-                    return 1;
+                    status = 1;
                 }
             }
         } else {
             // Copy stdin to clipboard
-            if (copy_to_clipboard(input)) {
+            if (copy_to_clipboard(&content)) {
                 printf("✓ Copied %ld characters from stdin to clipboard\n", 
-                       (long)strlen(input));
-                free(input);
-                return 0;
+                       (long)content.len);
             } else {
                 fprintf(stderr, "✗ Failed to copy to clipboard\n");
-                free(input);
-                return 1;
+                status = 1;
             }
         }
+        buffer_free(&input);
+        return status;
     }
     
     // Handle delete mode
@@ -686,34 +5959,63 @@ int main(int argc, char *argv[]) {
     
     // Handle paste mode
     if (paste_mode) {
-        // Get clipboard content
-        char *clipboard = paste_from_clipboard();
-        if (!clipboard) {
+        // Open the clipboard; only the first chunk is read at this point
+        ClipReader clipboard;
+        if (history_index > 0) {
+            if (!clip_reader_open_history(&clipboard, history_index)) {
+                fprintf(stderr, "History entry %d is not available\n", history_index);
+                clip_reader_close(&clipboard);
+                return 1;
+            }
+        } else if (!clip_reader_open(&clipboard)) {
             fprintf(stderr, "Clipboard is empty or inaccessible\n");
+            clip_reader_close(&clipboard);
             return 1;
         }
         
-        size_t clip_len = strlen(clipboard);
-        if (clip_len == 0) {
+        if (clip_reader_empty(&clipboard)) {
             printf("Clipboard is empty. Nothing to paste.\n");
-            free(clipboard);
+            clip_reader_close(&clipboard);
             return 0;
         }
         
+        // Several destinations share one read of the clipboard
+        if (multi_paste) {
+            Buffer gathered;
+            buffer_init(&gathered);
+            const Buffer *content = &clipboard.data;
+            if (clipboard.fd >= 0 && !clipboard.eof) {
+                // Drain the pipe first so a failed helper stops the batch
+                bool read_ok = buffer_append(&gathered, clipboard.data.ptr, clipboard.data.len) &&
+                               buffer_read_fd(&gathered, clipboard.fd);
+                clipboard.eof = true;
+                if (!clip_reader_close(&clipboard) || !read_ok) {
+                    fprintf(stderr, "Error: Failed to read clipboard\n");
+                    buffer_free(&gathered);
+                    return 1;
+                }
+                content = &gathered;
+            }
+            int status = paste_to_paths(paths, path_count, content, append_mode, force_mode);
+            clip_reader_close(&clipboard);
+            buffer_free(&gathered);
+            return status;
+        }
+        
         // If no filename is provided OR stdout mode is enabled, output to stdout
+        size_t pasted = 0;
         if (!filename || stdout_mode) {
-            printf("%s", clipboard);
-            free(clipboard);
-            return 0;
+            fflush(stdout);
+            bool success = clip_reader_to_fd(&clipboard, STDOUT_FILENO, NULL, &pasted);
+            clip_reader_close(&clipboard);
+            return success ? 0 : 1;
         }
         
         // Otherwise, paste to file
         // Check if file exists and needs confirmation
-        bool file_exists_already = file_exists(filename);
-        bool proceed = true;
+        off_t size = get_file_size(filename);  // -1 when it does not exist yet
         
-        if (file_exists_already && !append_mode && !force_mode) {
-            off_t size = get_file_size(filename);
+        if (size >= 0 && !append_mode && !force_mode) {
             if (size == 0) {
                 printf("Note: File '%s' exists but is empty. Proceeding.\n", filename);
             } else {
@@ -721,33 +6023,42 @@ int main(int argc, char *argv[]) {
                        filename, get_human_readable_size(size));
                 if (!get_user_confirmation("Do you want to overwrite it?", true)) {
                     printf("Operation cancelled.\n");
-                    free(clipboard);
+                    clip_reader_close(&clipboard);
                     return 2;  // User cancelled
                 }
             }
         }
         
-        if (append_mode) {
-            if (append_to_file(filename, clipboard)) {
-                printf("✓ Appended %ld bytes from clipboard to '%s'\n", 
-                       (long)clip_len, filename);
-                free(clipboard);
-                return 0;
-            } else {
-                free(clipboard);
-                return 1;
-            }
+        // A fully prefetched clip has a known size to preallocate
+        OutputFile out;
+        size_t size_hint = clipboard.fd < 0 || clipboard.eof ? clipboard.data.len : 0;
+        if (!output_open(&out, filename, append_mode, size_hint)) {
+            clip_reader_close(&clipboard);
+            return 1;
+        }
+        
+        // Appends are separated from existing content by a newline
+        struct stat st;
+        Buffer separator = buffer_view("\n", 1);
+        bool separate = append_mode && fstat(out.fd, &st) == 0 && st.st_size > 0;
+        
+        bool success = clip_reader_to_fd(&clipboard, out.fd, separate ? &separator : NULL, &pasted);
+        if (success) {
+            success = output_commit(&out);
         } else {
-            if (write_to_file(filename, clipboard, false, force_mode)) {
-                printf("✓ Pasted %ld bytes from clipboard to '%s'\n", 
-                       (long)clip_len, filename);
-                free(clipboard);
-                return 0;
-            } else {
-                free(clipboard);
-                return 1;
-            }
+            int saved = errno;
+            output_abort(&out);
+            errno = saved;
+        }
+        clip_reader_close(&clipboard);
+        
+        if (!success) {
+            fprintf(stderr, "Error writing to '%s': %s\n", filename, strerror(errno));
+            return 1;
         }
+        printf("✓ %s %ld bytes from clipboard to '%s'\n", 
+               append_mode ? "Appended" : "Pasted", (long)pasted, filename);
+        return 0;
     }
     
     // Handle copy mode (default)
@@ -755,18 +6066,15 @@ int main(int argc, char *argv[]) {
         if (!filename) {
             // If no filename but we have stdin data, process it
             if (!is_interactive) {
-                char *input = read_from_stdin();
-                if (input) {
-                    bool success = copy_to_clipboard(input);
-                    if (success) {
-                        printf("✓ Copied %ld characters from stdin to clipboard\n", 
-                               (long)strlen(input));
-                    } else {
-                        fprintf(stderr, "✗ Failed to copy to clipboard\n");
-                    }
-                    free(input);
-                    return success ? 0 : 1;
+                size_t copied = 0;
+                bool success = copy_stream_to_clipboard(fileno(stdin), &copied);
+                if (success) {
+                    printf("✓ Copied %ld characters from stdin to clipboard\n", 
+                           (long)copied);
+                } else {
+                    fprintf(stderr, "✗ Failed to copy to clipboard\n");
                 }
+                return success ? 0 : 1;
             }
             
             fprintf(stderr, "Error: File name or input required for copy operation\n");
@@ -774,81 +6082,162 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         
-        if (!file_exists(filename)) {
-            fprintf(stderr, "Error: File '%s' does not exist\n", filename);
-            return 1;
+        // Everything below works on this one open fd
+        FileSession session;
+        session.fd = -1;
+        if (path_count == 1) {
+            if (!file_session_open(&session, filename, O_RDONLY)) return 1;
+            if (S_ISDIR(session.st.st_mode)) file_session_close(&session);
+        }
+        
+        // Several files, or a directory, are bundled together
+        if (session.fd < 0) {
+            FileList list;
+            memset(&list, 0, sizeof(list));
+            for (int i = 0; i < path_count; i++) {
+                if (!file_list_collect(&list, paths[i], true)) {
+                    file_list_free(&list);
+                    return 1;
+                }
+            }
+            if (list.count == 0) {
+                fprintf(stderr, "Error: No files to copy\n");
+                return 1;
+            }
+            if (max_size > 0 && list.total_size > max_size && !force_mode) {
+                printf("Warning: Files total %s", get_human_readable_size(list.total_size));
+                printf(" (limit %s).\n", get_human_readable_size(max_size));
+                if (!get_user_confirmation("Do you want to continue?", true)) {
+                    printf("Operation cancelled.\n");
+                    file_list_free(&list);
+                    return 2;  // User cancelled
+                }
+                max_size = 0;
+            }
+            int status = copy_bundle(&list, force_mode ? 0 : max_size, stdout_mode);
+            file_list_free(&list);
+            return status;
         }
         
-        if (!is_regular_file(filename)) {
+        if (!S_ISREG(session.st.st_mode)) {
             fprintf(stderr, "Error: '%s' is not a regular file\n", filename);
+            file_session_close(&session);
             return 1;
         }
         
         // Check file size for large files
-        off_t file_size = get_file_size(filename);
+        off_t file_size = session.st.st_size;
         if (file_size == 0 && !force_mode) {
             printf("Warning: File '%s' is empty.\n", filename);
             if (!get_user_confirmation("Do you want to copy empty content?", true)) {
                 printf("Operation cancelled.\n");
+                file_session_close(&session);
                 return 2;  // User cancelled
             }
-        } else if (file_size > MAX_FILE_SIZE && !force_mode) {
-            printf("Warning: File is large (%s).\n", get_human_readable_size(file_size));
-            if (!get_user_confirmation("Do you want to continue?", true)) {
-                printf("Operation cancelled.\n");
-                return 2;  // User cancelled
+        } else if (max_size > 0 && file_size > max_size && tail_lines <= 0 && lines_limit <= 0 &&
+                   range_first == 0) {
+            // -f lifts the limit; otherwise the user has to opt in explicitly
+            if (!force_mode) {
+                printf("Warning: File is large (%s", get_human_readable_size(file_size));
+                printf(", limit %s).\n", get_human_readable_size(max_size));
+                if (!get_user_confirmation("Do you want to continue?", true)) {
+                    printf("Operation cancelled.\n");
+                    file_session_close(&session);
+                    return 2;  // User cancelled
+                }
             }
+            max_size = 0;
         }
         
-        char *content = read_file(filename);
-        if (!content) {
+        // Whole-file copies go straight from the file to the clipboard backend,
+        // or with -o to stdout without passing through a userspace buffer
+        bool whole_file = lines_limit <= 0 && tail_lines <= 0 && range_first == 0;
+        if (whole_file && transforms_active(&file_transforms)) {
+            file_session_advise_sequential(&session);
+            int status = deliver_transformed(&file_transforms, session.fd, NULL, max_size, stdout_mode, filename);
+            file_session_close(&session);
+            return status;
+        }
+        if (whole_file && (!stdout_mode || !IS_WINDOWS)) {
+            file_session_advise_sequential(&session);
+#ifndef _WIN32
+            if (stdout_mode) {
+                fflush(stdout);
+                ssize_t n = stream_fd(session.fd, NULL, STDOUT_FILENO);
+                if (n < 0) {
+                    fprintf(stderr, "Error writing '%s' to stdout: %s\n", filename, strerror(errno));
+                }
+                file_session_close(&session);
+                return n < 0 ? 1 : 0;
+            }
+#endif
+            size_t copied = 0;
+            bool success = copy_stream_to_clipboard(session.fd, &copied);
+            file_session_close(&session);
+            if (success) {
+                printf("✓ Copied %ld characters from '%s' to clipboard\n", 
+                       (long)copied, filename);
+                return 0;
+            }
+            print_clipboard_hint();
             return 1;
         }
         
-        // Apply line limits if specified
-        char *processed_content = content;
+        // Head stops reading once the requested lines are in
         if (lines_limit > 0) {
-            char *limited = get_first_n_lines(content, lines_limit);
-            if (limited) {
-                processed_content = limited;
-                free(content);
-                content = processed_content;
-            }
-        } else if (tail_lines > 0) {
-            char *limited = get_last_n_lines(content, tail_lines);
-            if (limited) {
-                processed_content = limited;
-                free(content);
-                content = processed_content;
-            }
+            Buffer head;
+            bool success = read_first_n_lines(session.fd, lines_limit, max_size, &head);
+            file_session_close(&session);
+            if (!success) return 1;
+            
+            int status = deliver_transformed(&file_transforms, -1, &head, 0, stdout_mode, filename);
+            buffer_free(&head);
+            return status;
         }
         
-        if (stdout_mode) {
-            printf("%s", processed_content);
-            free(processed_content);
-            return 0;
-        } else {
-            if (copy_to_clipboard(processed_content)) {
-                printf("✓ Copied %ld characters from '%s' to clipboard\n", 
-                       (long)strlen(processed_content), filename);
-                free(processed_content);
-                return 0;
-            } else {
-                fprintf(stderr, "✗ Failed to copy to clipboard\n");
-                fprintf(stderr, "You may need to install clipboard utilities:\n");
-#ifdef _WIN32
-                fprintf(stderr, "  Windows: Built-in clipboard should work\n");
-#elif __APPLE__
-                fprintf(stderr, "  macOS: Built-in clipboard should work\n");
-#else
-                fprintf(stderr, "  Linux: Install 'xclip' or 'xsel':\n");
-                fprintf(stderr, "    sudo apt-get install xclip\n");
-                fprintf(stderr, "    sudo apt-get install xsel\n");
+#ifndef _WIN32
+        // Tail only ever reads the blocks it needs, however large the file
+        if (tail_lines > 0) {
+            Buffer tail;
+            bool success = read_last_n_lines(session.fd, tail_lines, max_size, &tail);
+            file_session_close(&session);
+            if (!success) return 1;
+            
+            int status = deliver_transformed(&file_transforms, -1, &tail, 0, stdout_mode, filename);
+            buffer_free(&tail);
+            return status;
+        }
+        
+        // Ranges read only the indexed region around the selected lines
+        if (range_first > 0) {
+            Buffer range;
+            bool success = read_line_range(&session, range_first, range_last, max_size, &range);
+            file_session_close(&session);
+            if (!success) return 1;
+            
+            int status = deliver_transformed(&file_transforms, -1, &range, 0, stdout_mode, filename);
+            buffer_free(&range);
+            return status;
+        }
 #endif
-                free(processed_content);
-                return 1;
-            }
+        
+        Buffer file_content;
+        bool success = file_session_read(&session, max_size, &file_content);
+        file_session_close(&session);
+        if (!success) return 1;
+        
+        // Apply line limits if specified
+        Buffer content = file_content;
+        if (tail_lines > 0) {
+            content = get_last_n_lines(&file_content, tail_lines);
         }
+        if (range_first > 0) {
+            content = get_line_range(&file_content, range_first, range_last);
+        }
+        
+        int status = deliver_transformed(&file_transforms, -1, &content, 0, stdout_mode, filename);
+        buffer_free(&file_content);
+        return status;
     }
     
     // Default: show help